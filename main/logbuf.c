@@ -0,0 +1,114 @@
+#include "logbuf.h"
+
+#include <esp_log.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+
+// slot sequence marker used while a producer is formatting into the slot
+#define LOGBUF_SEQ_BUSY UINT32_MAX
+
+typedef struct {
+    _Atomic uint32_t seq;
+    char line[LOGBUF_LINE_SIZE];
+} logbuf_slot_t;
+
+static logbuf_slot_t logbuf_slots[LOGBUF_LINES];
+static _Atomic uint32_t logbuf_next_seq;
+static vprintf_like_t logbuf_prev_vprintf;
+
+static int logbuf_vprintf(const char *format, va_list args) {
+    va_list args_copy;
+    size_t len;
+
+    // each producer reserves its own slot, so the hook never waits on readers or other tasks
+    uint32_t seq = atomic_fetch_add_explicit(&logbuf_next_seq, 1, memory_order_relaxed);
+    logbuf_slot_t *slot = &logbuf_slots[seq % LOGBUF_LINES];
+
+    atomic_store_explicit(&slot->seq, LOGBUF_SEQ_BUSY, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    va_copy(args_copy, args);
+    vsnprintf(slot->line, sizeof(slot->line), format, args_copy);
+    va_end(args_copy);
+
+    len = strlen(slot->line);
+    while (len > 0 && (slot->line[len - 1] == '\n' || slot->line[len - 1] == '\r')) {
+        slot->line[--len] = '\0';
+    }
+
+    atomic_store_explicit(&slot->seq, seq, memory_order_release);
+
+    if (logbuf_prev_vprintf != NULL) {
+        return logbuf_prev_vprintf(format, args);
+    }
+
+    return vprintf(format, args);
+}
+
+esp_err_t logbuf_init(void) {
+    uint32_t i;
+
+    for (i = 0; i < LOGBUF_LINES; i++) {
+        atomic_init(&logbuf_slots[i].seq, LOGBUF_SEQ_BUSY);
+    }
+    atomic_init(&logbuf_next_seq, 0);
+
+    logbuf_prev_vprintf = esp_log_set_vprintf(logbuf_vprintf);
+
+    return ESP_OK;
+}
+
+uint32_t logbuf_head(void) { return atomic_load_explicit(&logbuf_next_seq, memory_order_acquire); }
+
+uint32_t logbuf_tail(void) {
+    uint32_t head = logbuf_head();
+
+    return head > LOGBUF_LINES ? head - LOGBUF_LINES : 0;
+}
+
+int logbuf_read(uint32_t *seq, char *buf, size_t buf_size) {
+    uint32_t head = logbuf_head();
+    uint32_t tail = head > LOGBUF_LINES ? head - LOGBUF_LINES : 0;
+
+    if (*seq >= head) {
+        return LOGBUF_READ_EMPTY;
+    }
+
+    if (*seq < tail) {
+        *seq = tail;
+        return LOGBUF_READ_GAP;
+    }
+
+    logbuf_slot_t *slot = &logbuf_slots[*seq % LOGBUF_LINES];
+
+    uint32_t slot_seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+    if (slot_seq == LOGBUF_SEQ_BUSY || slot_seq < *seq) {
+        // reserved but not yet committed
+        return LOGBUF_READ_EMPTY;
+    }
+
+    if (slot_seq == *seq) {
+        // bounded copy, the line may be rewritten underneath us
+        size_t len = strnlen(slot->line, sizeof(slot->line) - 1);
+        if (len > buf_size - 1) {
+            len = buf_size - 1;
+        }
+        memcpy(buf, slot->line, len);
+        buf[len] = '\0';
+
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&slot->seq, memory_order_relaxed) == *seq) {
+            *seq += 1;
+            return LOGBUF_READ_OK;
+        }
+    }
+
+    // overwritten by a producer while we were looking, skip to what is still held
+    head = logbuf_head();
+    tail = head > LOGBUF_LINES ? head - LOGBUF_LINES : 0;
+    *seq = tail > *seq ? tail : *seq + 1;
+
+    return LOGBUF_READ_GAP;
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+
+#define LOGBUF_LINE_SIZE 128
+#define LOGBUF_LINES 64
+
+#define LOGBUF_READ_OK 0
+#define LOGBUF_READ_EMPTY 1
+#define LOGBUF_READ_GAP 2
+
+esp_err_t logbuf_init(void);
+
+// sequence number of the next line to be written
+uint32_t logbuf_head(void);
+
+// sequence number of the oldest line still held in the buffer
+uint32_t logbuf_tail(void);
+
+// read line *seq into buf; on LOGBUF_READ_OK or LOGBUF_READ_GAP *seq is advanced to the next readable line
+int logbuf_read(uint32_t *seq, char *buf, size_t buf_size);
+
+#ifdef __cplusplus
+}
+#endif
@@ -3,6 +3,8 @@
 #include <nvs_flash.h>
 
 #include <esp_log.h>
+#include <esp_mac.h>
+#include <esp_timer.h>
 #include <esp_wifi.h>
 
 #include <mdns.h>
@@ -10,7 +12,11 @@
 #include "esp_image_format.h"
 #include "esp_ota_ops.h"
 
+#include "logbuf.h"
+#include "metrics.h"
+#include "otamcast.h"
 #include "otaserver.h"
+#include "otatcp.h"
 
 #define TAG "OTA"
 #define INFO(format, ...)                                                                                             \
@@ -27,6 +33,8 @@
         esp_restart();                                                                                                \
     } while (0)
 
+#define WIFI_SAMPLE_INTERVAL_MS (5000)
+
 #define HOSTNAME "meshtastic-ota"
 #define MDNS_INSTANCE "Meshtastic OTA Web server"
 
@@ -52,6 +60,17 @@ static void nvs_read_config(wifi_credentials_t *config) {
     ESP_ERROR_CHECK(nvs_commit(s_nvs_handle));
 }
 
+static bool nvs_read_flag(const char *key) {
+    uint8_t value = 0;
+
+    esp_err_t err = nvs_get_u8(s_nvs_handle, key, &value);
+    if (err != ESP_ERR_NVS_NOT_FOUND) {
+        ESP_ERROR_CHECK(err);
+    }
+
+    return value != 0;
+}
+
 static void nvs_mark_updated() {
     ESP_ERROR_CHECK(nvs_set_u8(s_nvs_handle, "updated", 1));
     ESP_ERROR_CHECK(nvs_commit(s_nvs_handle));
@@ -73,6 +92,10 @@ static void event_handler(void *arg, esp_event_base_t event_base, int32_t event_
             esp_wifi_connect();
 
         } else if (event_id == WIFI_EVENT_STA_DISCONNECTED) {
+            wifi_event_sta_disconnected_t *disconnected = (wifi_event_sta_disconnected_t *)event_data;
+            WARN("WiFi disconnected (reason %d)", disconnected->reason);
+            metrics_wifi_disconnect();
+
             if (s_retry_num < wifi_connect_retries) {
                 INFO("WiFi connect retry");
                 esp_wifi_connect();
@@ -113,8 +136,11 @@ static void wifi_connect(const wifi_credentials_t *config) {
     ESP_ERROR_CHECK(
         esp_event_handler_instance_register(IP_EVENT, IP_EVENT_STA_GOT_IP, &event_handler, NULL, &instance_got_ip));
 
+    // scan every channel and join the strongest BSSID advertising the SSID
     wifi_config_t wifi_config = {
         .sta.threshold.authmode = WIFI_AUTH_WPA_PSK,
+        .sta.scan_method = WIFI_ALL_CHANNEL_SCAN,
+        .sta.sort_method = WIFI_CONNECT_AP_BY_SIGNAL,
     };
     strncpy((char *)wifi_config.sta.ssid, config->ssid, sizeof(wifi_config.sta.ssid));
     strncpy((char *)wifi_config.sta.password, config->psk, sizeof(wifi_config.sta.password));
@@ -123,6 +149,15 @@ static void wifi_connect(const wifi_credentials_t *config) {
     ESP_ERROR_CHECK(esp_wifi_set_storage(WIFI_STORAGE_RAM));
     ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
     ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &wifi_config));
+
+    if (esp_wifi_set_protocol(WIFI_IF_STA, WIFI_PROTOCOL_11B | WIFI_PROTOCOL_11G | WIFI_PROTOCOL_11N) != ESP_OK) {
+        WARN("Unable to enable 802.11n");
+    }
+
+    // the link falls back to HT20 when the AP does not do HT40
+    if (esp_wifi_set_bandwidth(WIFI_IF_STA, WIFI_BW_HT40) != ESP_OK) {
+        WARN("Unable to enable HT40");
+    }
     ESP_ERROR_CHECK(esp_wifi_start());
 
     EventBits_t bits =
@@ -133,6 +168,72 @@ static void wifi_connect(const wifi_credentials_t *config) {
     }
 }
 
+static const char *get_phy_mode_str(wifi_phy_mode_t mode) {
+    switch (mode) {
+        case WIFI_PHY_MODE_LR:
+            return "lr";
+        case WIFI_PHY_MODE_11B:
+            return "11b";
+        case WIFI_PHY_MODE_11G:
+            return "11g";
+        case WIFI_PHY_MODE_HT20:
+            return "ht20";
+        case WIFI_PHY_MODE_HT40:
+            return "ht40";
+        case WIFI_PHY_MODE_HE20:
+            return "he20";
+        default:
+            return "unknown";
+    }
+}
+
+static void wifi_sample(void *arg) {
+    wifi_ap_record_t ap_info;
+    wifi_phy_mode_t phy_mode;
+    metrics_wifi_t sample = {0};
+
+    if (esp_wifi_sta_get_ap_info(&ap_info) != ESP_OK) {
+        return;
+    }
+
+    memcpy(sample.bssid, ap_info.bssid, sizeof(sample.bssid));
+    sample.channel = ap_info.primary;
+    sample.second_channel = ap_info.second;
+    sample.rssi = ap_info.rssi;
+
+    // esp_wifi_get_bandwidth() only returns what was requested, the negotiated mode tells whether HT40 is in use
+    if (esp_wifi_sta_get_negotiated_phymode(&phy_mode) == ESP_OK) {
+        sample.phy_mode = get_phy_mode_str(phy_mode);
+        sample.bandwidth_mhz = phy_mode == WIFI_PHY_MODE_HT40 ? 40 : 20;
+    } else {
+        sample.phy_mode = "unknown";
+    }
+
+    esp_wifi_get_max_tx_power(&sample.max_tx_power);
+
+    metrics_wifi_sample(&sample);
+}
+
+static void wifi_telemetry_start(void) {
+    esp_timer_handle_t timer;
+    wifi_ap_record_t ap_info;
+
+    const esp_timer_create_args_t timer_args = {
+        .callback = &wifi_sample,
+        .name = "wifi_sample",
+    };
+
+    if (esp_wifi_sta_get_ap_info(&ap_info) == ESP_OK) {
+        INFO("Joined BSSID " MACSTR " on channel %d%s, RSSI %d dBm", MAC2STR(ap_info.bssid), ap_info.primary,
+             ap_info.second != WIFI_SECOND_CHAN_NONE ? " (HT40 capable)" : "", ap_info.rssi);
+    }
+
+    wifi_sample(NULL);
+
+    ESP_ERROR_CHECK(esp_timer_create(&timer_args, &timer));
+    ESP_ERROR_CHECK(esp_timer_start_periodic(timer, WIFI_SAMPLE_INTERVAL_MS * 1000ULL));
+}
+
 static void mdns_setup(void) {
     ESP_ERROR_CHECK(mdns_init());
 
@@ -246,15 +347,20 @@ static void print_info(void) {
     }
 }
 
-static void otaserver_event_cb(uint8_t event) {
+static void otaserver_event_cb(uint8_t event, uint8_t reason) {
     switch (event) {
         case OTA_EVENT_SUCCESS:
             nvs_mark_updated();
             break;
+        case OTA_EVENT_FAILED:
+            WARN("OTA failed (%s)", metrics_failure_name(reason));
+            break;
     }
 }
 
 void app_main() {
+    ESP_ERROR_CHECK(logbuf_init());
+
     print_info();
     nvs_init("MeshtasticOTA");
 
@@ -264,10 +370,19 @@ void app_main() {
 
     INFO("Connecting to WiFi AP \"%s\"", config.ssid);
     wifi_connect(&config);
+    wifi_telemetry_start();
 
     INFO("Setting hostname and mDNS");
     mdns_setup();
 
     INFO("Starting web server");
     ESP_ERROR_CHECK(otaserver_start(&otaserver_event_cb));
+
+    INFO("Starting TCP OTA server");
+    ESP_ERROR_CHECK(otatcp_start(&otaserver_event_cb));
+
+    if (nvs_read_flag("mcast")) {
+        INFO("Starting multicast OTA receiver");
+        ESP_ERROR_CHECK(otamcast_start(&otaserver_event_cb));
+    }
 }
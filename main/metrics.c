@@ -0,0 +1,130 @@
+#include "metrics.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+
+typedef struct {
+    uint32_t sessions;
+    uint32_t successes;
+    uint32_t failures[OTA_FAILURE_COUNT];
+    uint8_t last_result;
+    uint32_t last_bytes;
+    uint32_t last_duration_ms;
+    uint32_t last_throughput_bps;
+    int8_t last_rssi;
+} metrics_ota_t;
+
+static portMUX_TYPE metrics_lock = portMUX_INITIALIZER_UNLOCKED;
+static metrics_ota_t metrics_ota;
+static metrics_wifi_t metrics_wifi = {.phy_mode = "unknown"};
+static uint32_t metrics_wifi_samples;
+static uint32_t metrics_wifi_disconnects;
+
+static const char *failure_names[OTA_FAILURE_COUNT] = {
+    [OTA_FAILURE_NONE] = "none",
+    [OTA_FAILURE_STALL] = "stall",
+    [OTA_FAILURE_SLOW_CLIENT] = "slow_client",
+    [OTA_FAILURE_SHORT_BODY] = "short_body",
+    [OTA_FAILURE_RECV_ERROR] = "recv_error",
+    [OTA_FAILURE_FLASH_ERROR] = "flash_error",
+    [OTA_FAILURE_INVALID_IMAGE] = "invalid_image",
+    [OTA_FAILURE_BUSY] = "busy",
+};
+
+const char *metrics_failure_name(uint8_t reason) {
+    if (reason >= OTA_FAILURE_COUNT) {
+        return "unknown";
+    }
+
+    return failure_names[reason];
+}
+
+void metrics_ota_begin(void) {
+    portENTER_CRITICAL(&metrics_lock);
+    metrics_ota.sessions++;
+    portEXIT_CRITICAL(&metrics_lock);
+}
+
+void metrics_ota_result(uint8_t reason, size_t bytes, int64_t duration_us) {
+    portENTER_CRITICAL(&metrics_lock);
+
+    if (reason == OTA_FAILURE_NONE) {
+        metrics_ota.successes++;
+    } else if (reason < OTA_FAILURE_COUNT) {
+        metrics_ota.failures[reason]++;
+    }
+
+    metrics_ota.last_result = reason;
+    metrics_ota.last_bytes = bytes;
+    metrics_ota.last_duration_ms = duration_us / 1000;
+    metrics_ota.last_throughput_bps = duration_us > 0 ? (uint64_t)bytes * 1000000 / duration_us : 0;
+    metrics_ota.last_rssi = metrics_wifi.rssi;
+
+    portEXIT_CRITICAL(&metrics_lock);
+}
+
+void metrics_wifi_sample(const metrics_wifi_t *sample) {
+    portENTER_CRITICAL(&metrics_lock);
+    memcpy(&metrics_wifi, sample, sizeof(metrics_wifi));
+    metrics_wifi_samples++;
+    portEXIT_CRITICAL(&metrics_lock);
+}
+
+void metrics_wifi_disconnect(void) {
+    portENTER_CRITICAL(&metrics_lock);
+    metrics_wifi_disconnects++;
+    portEXIT_CRITICAL(&metrics_lock);
+}
+
+size_t metrics_format(char *buf, size_t size) {
+    metrics_ota_t ota;
+    metrics_wifi_t wifi;
+    uint32_t wifi_samples;
+    uint32_t wifi_disconnects;
+    size_t len = 0;
+    uint8_t i;
+
+    portENTER_CRITICAL(&metrics_lock);
+    memcpy(&ota, &metrics_ota, sizeof(ota));
+    memcpy(&wifi, &metrics_wifi, sizeof(wifi));
+    wifi_samples = metrics_wifi_samples;
+    wifi_disconnects = metrics_wifi_disconnects;
+    portEXIT_CRITICAL(&metrics_lock);
+
+#define METRICS_APPEND(format, ...)                                                                                   \
+    do {                                                                                                              \
+        if (len < size) {                                                                                             \
+            len += snprintf(buf + len, size - len, format, ##__VA_ARGS__);                                            \
+        }                                                                                                             \
+    } while (0)
+
+    METRICS_APPEND("ota_sessions_total %" PRIu32 "\n", ota.sessions);
+    METRICS_APPEND("ota_success_total %" PRIu32 "\n", ota.successes);
+
+    for (i = OTA_FAILURE_NONE + 1; i < OTA_FAILURE_COUNT; i++) {
+        METRICS_APPEND("ota_failures_total{reason=\"%s\"} %" PRIu32 "\n", failure_names[i], ota.failures[i]);
+    }
+
+    METRICS_APPEND("ota_last_result{reason=\"%s\"} 1\n", metrics_failure_name(ota.last_result));
+    METRICS_APPEND("ota_last_bytes %" PRIu32 "\n", ota.last_bytes);
+    METRICS_APPEND("ota_last_duration_ms %" PRIu32 "\n", ota.last_duration_ms);
+    METRICS_APPEND("ota_last_throughput_bps %" PRIu32 "\n", ota.last_throughput_bps);
+    METRICS_APPEND("ota_last_rssi_dbm %d\n", ota.last_rssi);
+
+    METRICS_APPEND("wifi_samples_total %" PRIu32 "\n", wifi_samples);
+    METRICS_APPEND("wifi_disconnects_total %" PRIu32 "\n", wifi_disconnects);
+    METRICS_APPEND("wifi_info{bssid=\"%02x:%02x:%02x:%02x:%02x:%02x\",phy_mode=\"%s\"} 1\n", wifi.bssid[0],
+                   wifi.bssid[1], wifi.bssid[2], wifi.bssid[3], wifi.bssid[4], wifi.bssid[5], wifi.phy_mode);
+    METRICS_APPEND("wifi_rssi_dbm %d\n", wifi.rssi);
+    METRICS_APPEND("wifi_channel %d\n", wifi.channel);
+    METRICS_APPEND("wifi_second_channel %d\n", wifi.second_channel);
+    METRICS_APPEND("wifi_bandwidth_mhz %d\n", wifi.bandwidth_mhz);
+    METRICS_APPEND("wifi_max_tx_power_quarter_dbm %d\n", wifi.max_tx_power);
+
+#undef METRICS_APPEND
+
+    return len < size ? len : size - 1;
+}
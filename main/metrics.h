@@ -0,0 +1,37 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "otaserver.h"
+
+#define METRICS_BUFFSIZE 2048
+
+typedef struct {
+    uint8_t bssid[6];
+    uint8_t channel;
+    uint8_t second_channel; /*!< 0 none, 1 above, 2 below */
+    int8_t rssi;
+    uint8_t bandwidth_mhz; /*!< 0 while the negotiated mode is unknown */
+    int8_t max_tx_power; /*!< in 0.25 dBm units */
+    const char *phy_mode;
+} metrics_wifi_t;
+
+void metrics_ota_begin(void);
+void metrics_ota_result(uint8_t reason, size_t bytes, int64_t duration_us);
+
+void metrics_wifi_sample(const metrics_wifi_t *sample);
+void metrics_wifi_disconnect(void);
+
+const char *metrics_failure_name(uint8_t reason);
+
+// render all metrics in Prometheus text format, returns the length written
+size_t metrics_format(char *buf, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
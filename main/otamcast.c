@@ -0,0 +1,374 @@
+#include "otamcast.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "lwip/sockets.h"
+#include "otawriter.h"
+
+#define TAG "otamcast"
+
+#define BITMAP_GET(bitmap, n) ((bitmap)[(n) >> 3] & (1 << ((n) & 7)))
+#define BITMAP_SET(bitmap, n) ((bitmap)[(n) >> 3] |= (1 << ((n) & 7)))
+
+typedef struct {
+    bool active;
+    bool completed;
+    uint8_t rejected; // OTA_FAILURE_* reason the image identified by sha256 failed with
+    ota_writer_t writer;
+    uint8_t sha256[OTA_WRITER_SHA256_LEN];
+    uint32_t image_len;
+    uint16_t block_size;
+    uint32_t block_count;
+    uint32_t received;
+    uint8_t *bitmap;
+    struct sockaddr_in sender;
+    int64_t last_packet_us;
+    int64_t last_nack_us;
+    int64_t last_busy_log_us;
+} otamcast_session_t;
+
+static otaserver_event_cb_t otamcast_event_cb;
+static otamcast_session_t otamcast_session;
+static uint8_t otamcast_packet[sizeof(ota_mcast_header_t) + OTA_MCAST_BLOCK_MAXLEN];
+
+// reason is ignored when the writer already aborted the session itself
+static void otamcast_session_stop(otamcast_session_t *session, uint8_t reason) {
+    if (reason != OTA_FAILURE_NONE) {
+        ota_writer_abort(&session->writer, reason);
+
+        if (otamcast_event_cb != NULL) {
+            (*otamcast_event_cb)(OTA_EVENT_FAILED, session->writer.failure);
+        }
+
+        // a sender that went away may come back with the same image, anything else would only fail again
+        if (session->writer.failure != OTA_FAILURE_STALL) {
+            session->rejected = session->writer.failure;
+        }
+    }
+
+    free(session->bitmap);
+    session->bitmap = NULL;
+    session->active = false;
+}
+
+static esp_err_t otamcast_session_start(otamcast_session_t *session, const ota_mcast_header_t *header,
+                                        const struct sockaddr_in *from) {
+    esp_err_t err;
+
+    // every packet of the stream ends up here while an HTTP or TCP upload holds the partition, so neither claim the
+    // writer (a failed claim is counted as a busy failure) nor log each one
+    if (ota_writer_is_busy()) {
+        int64_t now = esp_timer_get_time();
+
+        if (session->last_busy_log_us == 0 ||
+            now - session->last_busy_log_us > OTA_MCAST_BUSY_LOG_INTERVAL_MS * 1000LL) {
+            ESP_LOGW(TAG, "another OTA session is in progress, ignoring multicast image");
+            session->last_busy_log_us = now;
+        }
+
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    memcpy(session->sha256, header->sha256, sizeof(session->sha256));
+    session->image_len = header->image_len;
+    session->block_size = header->block_size;
+    session->sender = *from;
+    session->rejected = OTA_FAILURE_NONE;
+
+    if (header->block_size == 0 || header->block_size > OTA_MCAST_BLOCK_MAXLEN) {
+        ESP_LOGE(TAG, "unsupported block size %d", header->block_size);
+        session->rejected = OTA_FAILURE_INVALID_IMAGE;
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    err = ota_writer_begin(&session->writer);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    if (otamcast_event_cb != NULL) {
+        (*otamcast_event_cb)(OTA_EVENT_BEGIN, OTA_FAILURE_NONE);
+    }
+
+    err = ota_writer_prepare(&session->writer, header->image_len);
+    if (err != ESP_OK) {
+        if (otamcast_event_cb != NULL) {
+            (*otamcast_event_cb)(OTA_EVENT_FAILED, session->writer.failure);
+        }
+
+        session->rejected = session->writer.failure;
+        return err;
+    }
+
+    session->block_count = (header->image_len + header->block_size - 1) / header->block_size;
+    session->received = 0;
+    session->last_packet_us = esp_timer_get_time();
+    session->last_nack_us = 0;
+
+    session->bitmap = calloc((session->block_count + 7) / 8, 1);
+    if (session->bitmap == NULL) {
+        ESP_LOGE(TAG, "unable to allocate block bitmap");
+        otamcast_session_stop(session, OTA_FAILURE_RECV_ERROR);
+        return ESP_ERR_NO_MEM;
+    }
+
+    session->active = true;
+
+    ESP_LOGI(TAG, "receiving %" PRIu32 " bytes in %" PRIu32 " blocks from %s", session->image_len,
+             session->block_count, inet_ntoa(from->sin_addr));
+
+    return ESP_OK;
+}
+
+static void otamcast_send(int sock, const otamcast_session_t *session, uint8_t type, const void *payload,
+                          size_t len) {
+    ota_mcast_header_t *header = (ota_mcast_header_t *)otamcast_packet;
+
+    header->magic = OTA_MCAST_MAGIC;
+    header->type = type;
+    header->reserved = 0;
+    header->block_size = session->block_size;
+    header->image_len = session->image_len;
+    header->block = session->received;
+    memcpy(header->sha256, session->sha256, sizeof(header->sha256));
+    memcpy(otamcast_packet + sizeof(*header), payload, len);
+
+    sendto(sock, otamcast_packet, sizeof(*header) + len, 0, (const struct sockaddr *)&session->sender,
+           sizeof(session->sender));
+}
+
+static void otamcast_send_nack(int sock, otamcast_session_t *session) {
+    ota_mcast_range_t ranges[OTA_MCAST_NACK_MAX_RANGES];
+    size_t range_count = 0;
+    uint32_t block = 0;
+
+    while (block < session->block_count && range_count < OTA_MCAST_NACK_MAX_RANGES) {
+        if (BITMAP_GET(session->bitmap, block)) {
+            block++;
+            continue;
+        }
+
+        ranges[range_count].first = block;
+        while (block < session->block_count && !BITMAP_GET(session->bitmap, block)) {
+            block++;
+        }
+        ranges[range_count].count = block - ranges[range_count].first;
+        range_count++;
+    }
+
+    ESP_LOGI(TAG, "%" PRIu32 " of %" PRIu32 " blocks received, requesting %d ranges", session->received,
+             session->block_count, range_count);
+
+    otamcast_send(sock, session, OTA_MCAST_TYPE_NACK, ranges, range_count * sizeof(ota_mcast_range_t));
+    session->last_nack_us = esp_timer_get_time();
+}
+
+static void otamcast_finish(int sock, otamcast_session_t *session) {
+    esp_err_t err;
+
+    if (otamcast_event_cb != NULL) {
+        (*otamcast_event_cb)(OTA_EVENT_IDLE, OTA_FAILURE_NONE);
+    }
+
+    err = ota_writer_end(&session->writer, session->sha256);
+    if (err != ESP_OK) {
+        otamcast_session_stop(session, session->writer.failure);
+        return;
+    }
+
+    err = ota_writer_activate(&session->writer);
+    if (err != ESP_OK) {
+        otamcast_session_stop(session, session->writer.failure);
+        return;
+    }
+
+    otamcast_send(sock, session, OTA_MCAST_TYPE_DONE, NULL, 0);
+    otamcast_session_stop(session, OTA_FAILURE_NONE);
+    session->completed = true;
+
+    if (otamcast_event_cb != NULL) {
+        (*otamcast_event_cb)(OTA_EVENT_SUCCESS, OTA_FAILURE_NONE);
+    }
+
+    ESP_LOGI(TAG, "prepare to system restart");
+    xTaskCreate(esp_restart_task, "esp_restart_task", 1024, NULL, 5, NULL);
+}
+
+static void otamcast_handle_data(int sock, otamcast_session_t *session, const ota_mcast_header_t *header,
+                                 const uint8_t *data, size_t len) {
+    esp_err_t err;
+    size_t offset;
+
+    if (header->block >= session->block_count || BITMAP_GET(session->bitmap, header->block)) {
+        return;
+    }
+
+    offset = (size_t)header->block * session->block_size;
+    if (len != MIN(session->block_size, session->image_len - offset)) {
+        ESP_LOGW(TAG, "block %" PRIu32 " has unexpected length %d", header->block, len);
+        return;
+    }
+
+    err = ota_writer_write_at(&session->writer, offset, data, len);
+    if (err != ESP_OK) {
+        otamcast_session_stop(session, session->writer.failure);
+        return;
+    }
+
+    BITMAP_SET(session->bitmap, header->block);
+    session->received++;
+
+    if (session->received == session->block_count) {
+        otamcast_finish(sock, session);
+    }
+}
+
+// handle what recvfrom left in otamcast_packet, packet_len < 0 when the receive timed out
+static void otamcast_receive(int sock, otamcast_session_t *session, ssize_t packet_len,
+                             const struct sockaddr_in *from) {
+    const ota_mcast_header_t *header = (const ota_mcast_header_t *)otamcast_packet;
+    int64_t now = esp_timer_get_time();
+
+    if (packet_len >= (ssize_t)sizeof(*header) && header->magic == OTA_MCAST_MAGIC &&
+        (header->type == OTA_MCAST_TYPE_DATA || header->type == OTA_MCAST_TYPE_END)) {
+        if (session->completed) {
+            // the verified image is waiting for the restart, starting over would erase it again, just repeat
+            // DONE in case the first one got lost
+            if (header->type == OTA_MCAST_TYPE_END &&
+                memcmp(header->sha256, session->sha256, sizeof(session->sha256)) == 0) {
+                session->sender = *from;
+                otamcast_send(sock, session, OTA_MCAST_TYPE_DONE, NULL, 0);
+            }
+
+            return;
+        }
+
+        if (!session->active && session->rejected != OTA_FAILURE_NONE &&
+            memcmp(header->sha256, session->sha256, sizeof(session->sha256)) == 0) {
+            // the sender repeats the image for the other nodes, starting over would erase the partition only to
+            // fail again, tell it why instead
+            if (header->type == OTA_MCAST_TYPE_END) {
+                session->sender = *from;
+                otamcast_send(sock, session, OTA_MCAST_TYPE_FAILED, &session->rejected, sizeof(session->rejected));
+            }
+
+            return;
+        }
+
+        if (!session->active) {
+            if (otamcast_session_start(session, header, from) != ESP_OK) {
+                return;
+            }
+
+        } else if (memcmp(header->sha256, session->sha256, sizeof(session->sha256)) != 0) {
+            // another image is being sent to the group, stick to the one we started with
+            return;
+        }
+
+        session->sender = *from;
+        session->last_packet_us = now;
+
+        if (otamcast_event_cb != NULL) {
+            (*otamcast_event_cb)(OTA_EVENT_IDLE, OTA_FAILURE_NONE);
+        }
+
+        if (header->type == OTA_MCAST_TYPE_DATA) {
+            otamcast_handle_data(sock, session, header, otamcast_packet + sizeof(*header),
+                                 packet_len - sizeof(*header));
+            return;
+        }
+    }
+
+    if (!session->active) {
+        return;
+    }
+
+    if (now - session->last_packet_us > OTA_MCAST_SESSION_TIMEOUT_MS * 1000LL) {
+        ESP_LOGE(TAG, "sender went away, aborting");
+        otamcast_session_stop(session, OTA_FAILURE_STALL);
+
+    } else if (now - session->last_nack_us > OTA_MCAST_NACK_INTERVAL_MS * 1000LL) {
+        // either the sender finished a pass or the group went quiet
+        otamcast_send_nack(sock, session);
+    }
+}
+
+static void otamcast_task(void *pvParameter) {
+    int sock = (int)(intptr_t)pvParameter;
+    ssize_t packet_len;
+
+    struct sockaddr_in from;
+    socklen_t from_len;
+
+    while (true) {
+        from_len = sizeof(from);
+        packet_len =
+            recvfrom(sock, otamcast_packet, sizeof(otamcast_packet), 0, (struct sockaddr *)&from, &from_len);
+
+        otamcast_receive(sock, &otamcast_session, packet_len, &from);
+    }
+}
+
+esp_err_t otamcast_start(otaserver_event_cb_t event_cb) {
+    int sock;
+    int opt = 1;
+
+    otamcast_event_cb = event_cb;
+
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(OTA_MCAST_PORT),
+        .sin_addr.s_addr = htonl(INADDR_ANY),
+    };
+
+    struct ip_mreq mreq = {
+        .imr_multiaddr.s_addr = inet_addr(OTA_MCAST_GROUP),
+        .imr_interface.s_addr = htonl(OTA_MCAST_INTERFACE),
+    };
+
+    struct timeval timeout = {
+        .tv_sec = OTA_MCAST_RECV_TIMEOUT_MS / 1000,
+        .tv_usec = (OTA_MCAST_RECV_TIMEOUT_MS % 1000) * 1000,
+    };
+
+    sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (sock < 0) {
+        ESP_LOGE(TAG, "unable to create socket (errno %d)", errno);
+        return ESP_FAIL;
+    }
+
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        ESP_LOGE(TAG, "unable to bind port %d (errno %d)", OTA_MCAST_PORT, errno);
+
+        close(sock);
+        return ESP_FAIL;
+    }
+
+    if (setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) != 0) {
+        ESP_LOGE(TAG, "unable to join group %s (errno %d)", OTA_MCAST_GROUP, errno);
+
+        close(sock);
+        return ESP_FAIL;
+    }
+
+    ESP_LOGI(TAG, "listening on group %s port: '%d'", OTA_MCAST_GROUP, OTA_MCAST_PORT);
+
+    if (xTaskCreate(otamcast_task, "otamcast_task", 4096, (void *)(intptr_t)sock, 5, NULL) != pdPASS) {
+        ESP_LOGE(TAG, "unable to start receiver task");
+
+        close(sock);
+        return ESP_ERR_NO_MEM;
+    }
+
+    return ESP_OK;
+}
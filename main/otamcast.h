@@ -0,0 +1,62 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+#include "esp_err.h"
+#include "otaserver.h"
+
+#define OTA_MCAST_GROUP "239.255.77.1"
+#define OTA_MCAST_PORT 3233
+
+// interface the group is joined on, host builds override it to receive over loopback
+#ifndef OTA_MCAST_INTERFACE
+#define OTA_MCAST_INTERFACE INADDR_ANY
+#endif
+
+#define OTA_MCAST_MAGIC 0x4d4f5441 /* "ATOM" on the wire */
+#define OTA_MCAST_BLOCK_MAXLEN 1024
+
+#define OTA_MCAST_TYPE_DATA 1
+#define OTA_MCAST_TYPE_END 2
+#define OTA_MCAST_TYPE_NACK 3
+#define OTA_MCAST_TYPE_DONE 4
+#define OTA_MCAST_TYPE_FAILED 5
+
+#define OTA_MCAST_NACK_MAX_RANGES 32
+
+#define OTA_MCAST_RECV_TIMEOUT_MS (1000)
+#define OTA_MCAST_NACK_INTERVAL_MS (500)
+#define OTA_MCAST_SESSION_TIMEOUT_MS (60000)
+#define OTA_MCAST_BUSY_LOG_INTERVAL_MS (10000)
+
+// All fields little-endian. DATA carries one block of the image, END tells receivers the sender finished a pass,
+// NACK (unicast to the sender) carries up to OTA_MCAST_NACK_MAX_RANGES {first, count} pairs of missing blocks and
+// DONE (unicast to the sender) reports a verified image, FAILED (unicast to the sender, answering END) reports an
+// image the receiver rejected and carries the OTA_FAILURE_* reason as a single byte. The image SHA-256 identifies
+// the session, a rejected image is ignored until another one is sent.
+// The sender announces an image with END before the first pass: a receiver erases the partition (and hears nothing
+// while doing so), then answers with a NACK for every block, which tells the sender it is ready.
+typedef struct __attribute__((packed)) {
+    uint32_t magic;
+    uint8_t type;
+    uint8_t reserved;
+    uint16_t block_size;
+    uint32_t image_len;
+    uint32_t block;
+    uint8_t sha256[32];
+} ota_mcast_header_t;
+
+typedef struct __attribute__((packed)) {
+    uint32_t first;
+    uint32_t count;
+} ota_mcast_range_t;
+
+esp_err_t otamcast_start(otaserver_event_cb_t);
+
+#ifdef __cplusplus
+}
+#endif
@@ -4,11 +4,18 @@
 #include <esp_log.h>
 #include <esp_system.h>
 #include <inttypes.h>
+#include <stdlib.h>
 #include <sys/param.h>
 
 #include "esp_http_server.h"
 #include "esp_image_format.h"
 #include "esp_ota_ops.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "logbuf.h"
+#include "lwip/sockets.h"
+#include "metrics.h"
+#include "otawriter.h"
 #include "spi_flash_mmap.h"
 
 #define TAG "otaserver"
@@ -24,9 +31,12 @@ static esp_pm_lock_handle_t pm_handle;
 #endif
 
 #define ARRAY_LEN(x) (sizeof(x) / sizeof(x[0]))
+#define STR_(x) #x
+#define STR(x) STR_(x)
 
 static httpd_handle_t otaserver;
 static otaserver_event_cb_t otaserver_event_cb;
+static volatile bool logs_streaming;
 
 const char index_html[] =
     "<!DOCTYPE html>"
@@ -38,32 +48,89 @@ const char index_html[] =
     "<body style=\"font-family: monospace\">"
     "  <h1>Firmware Update</h1>"
     "  <input type=\"file\" id=\"firmware\" accept=\".bin\"><br><br>"
-    "  <button onclick=\"uploadFirmware()\">Upload firmware</button>"
+    "  <button id=\"upload\" onclick=\"uploadFirmware()\">Upload firmware</button>"
     "  <button onclick=\"downloadCoredump()\">Download coredump</button>"
+    "  <button onclick=\"location.href = '/partition/ota_0'\">Download backup</button>"
     "  <button onclick=\"rebootToApp()\">Reboot to app</button>"
+    "  <button onclick=\"showLogs()\">Show logs</button>"
     "  <hr>"
+    "  <progress id=\"progress\" max=\"100\" value=\"0\" style=\"width: 100%\"></progress>"
     "  <pre id=\"status\"></pre>"
     "  <script>"
+    "    const CHIP_ID = " STR(CONFIG_IDF_FIRMWARE_CHIP_ID) ";"
+    "    const UPLOAD_RETRIES = " STR(OTA_UPLOAD_RETRIES) ";"
+    "    async function checkImage(file) {"
+    "      const header = new DataView(await file.slice(0, 36).arrayBuffer());"
+    "      if (header.byteLength < 36 || header.getUint8(0) != 0xE9) {"
+    "        return 'not an ESP firmware image';"
+    "      }"
+    "      if (header.getUint16(12, true) != CHIP_ID) {"
+    "        return 'image is built for chip id ' + header.getUint16(12, true) + ', this device is ' + CHIP_ID;"
+    "      }"
+    "      if (header.getUint32(32, true) != 0xABCD5432) {"
+    "        return 'image has no application descriptor';"
+    "      }"
+    "      return null;"
+    "    }"
+    "    function sendFirmware(file, status, progress) {"
+    "      return new Promise((resolve) => {"
+    "        const xhr = new XMLHttpRequest();"
+    "        let last = { time: performance.now(), loaded: 0 };"
+    "        let rate = 0;"
+    "        xhr.upload.onprogress = (e) => {"
+    "          const now = performance.now();"
+    "          if (now - last.time >= 500) {"
+    "            rate = (e.loaded - last.loaded) / (now - last.time) / 1000;"
+    "            last = { time: now, loaded: e.loaded };"
+    "          }"
+    "          progress.value = 100 * e.loaded / file.size;"
+    "          status.textContent = 'Uploading... ' + (e.loaded / 1e6).toFixed(2) + ' / ' +"
+    "            (file.size / 1e6).toFixed(2) + ' MB, ' + rate.toFixed(2) + ' MB/s';"
+    "        };"
+    "        xhr.onload = () => resolve(xhr.status);"
+    "        xhr.onerror = () => resolve(0);"
+    "        xhr.ontimeout = () => resolve(0);"
+    "        xhr.open('POST', '/ota');"
+    "        xhr.setRequestHeader('Content-Type', 'application/octet-stream');"
+    "        xhr.send(file);"
+    "      });"
+    "    }"
     "    async function uploadFirmware() {"
     "      const fileInput = document.getElementById('firmware');"
+    "      const button = document.getElementById('upload');"
+    "      const progress = document.getElementById('progress');"
     "      const status = document.getElementById('status');"
     "      if (!fileInput.files.length) {"
     "        status.textContent = 'No file selected.';"
     "        return;"
     "      }"
     "      const file = fileInput.files[0];"
-    "      const data = await file.arrayBuffer();"
-    "      try {"
-    "        status.textContent = 'Uploading...';"
-    "        const res = await fetch('/ota', {"
-    "          method: 'POST',"
-    "          headers: { 'Content-Type': 'application/octet-stream' },"
-    "          body: data"
-    "        });"
-    "        status.textContent = res.ok ? 'Upload successful.' : 'Upload failed: ' + res.statusText;"
-    "      } catch (err) {"
-    "        status.textContent = 'Error: ' + err;"
+    "      const problem = await checkImage(file);"
+    "      if (problem) {"
+    "        status.textContent = 'Rejected: ' + problem + '.';"
+    "        return;"
+    "      }"
+    "      button.disabled = true;"
+    "      const started = performance.now();"
+    "      for (let attempt = 1; attempt <= UPLOAD_RETRIES; attempt++) {"
+    "        progress.value = 0;"
+    "        const code = await sendFirmware(file, status, progress);"
+    "        if (code == 202) {"
+    "          const seconds = (performance.now() - started) / 1000;"
+    "          status.textContent = 'Upload successful, ' + (file.size / 1e6 / seconds).toFixed(2) +"
+    "            ' MB/s average. Rebooting...';"
+    "          button.disabled = false;"
+    "          return;"
+    "        }"
+    "        if (code == 400) {"
+    "          status.textContent = 'Upload failed: device rejected the image.';"
+    "          break;"
+    "        }"
+    "        status.textContent = 'Upload failed (' + (code || 'network error') + ')' +"
+    "          (attempt < UPLOAD_RETRIES ? ', retrying...' : '.');"
+    "        await new Promise((r) => setTimeout(r, 2000 * attempt));"
     "      }"
+    "      button.disabled = false;"
     "    }"
     "    async function downloadCoredump() {"
     "      const status = document.getElementById('status');"
@@ -81,6 +148,16 @@ const char index_html[] =
     "        status.textContent = 'Error: ' + err;"
     "      }"
     "    }"
+    "    async function showLogs() {"
+    "      const status = document.getElementById('status');"
+    "      try {"
+    "        const res = await fetch('/logs');"
+    "        if (!res.ok) throw new Error('Failed to fetch logs');"
+    "        status.textContent = await res.text();"
+    "      } catch (err) {"
+    "        status.textContent = 'Error: ' + err;"
+    "      }"
+    "    }"
     "    async function rebootToApp() {"
     "      const status = document.getElementById('status');"
     "      try {"
@@ -96,213 +173,138 @@ const char index_html[] =
     "</body>"
     "</html>";
 
-void esp_restart_task(void *pvParameter);
+static const char *ota_failure_status(uint8_t reason) {
+    switch (reason) {
+        case OTA_FAILURE_STALL:
+        case OTA_FAILURE_SLOW_CLIENT:
+            return HTTPD_408;
+        case OTA_FAILURE_BUSY:
+            return HTTPD_503;
+        case OTA_FAILURE_FLASH_ERROR:
+            return HTTPD_500;
+        default:
+            return HTTPD_400;
+    }
+}
+
+static esp_err_t ota_post_fail(httpd_req_t *req, uint8_t reason) {
+    httpd_resp_set_status(req, ota_failure_status(reason));
+    httpd_resp_send(req, NULL, 0);
+
+    if (otaserver_event_cb != NULL) {
+        (*otaserver_event_cb)(OTA_EVENT_FAILED, reason);
+    }
+
+    PM_LOCK_RELEASE();
+    return ESP_FAIL;
+}
 
 esp_err_t ota_post_handler(httpd_req_t *req) {
     esp_err_t err;
-    bool image_header_was_checked;
+    ota_writer_t writer;
+    uint8_t reason;
 
     char ota_write_data[OTA_BUFFSIZE + 1];
 
     ssize_t data_read;
     size_t binary_file_length;
+    size_t buffered;
 
     PM_LOCK_ACQUIRE();
 
     if (otaserver_event_cb != NULL) {
-        (*otaserver_event_cb)(OTA_EVENT_BEGIN);
+        (*otaserver_event_cb)(OTA_EVENT_BEGIN, OTA_FAILURE_NONE);
     }
 
-    esp_ota_handle_t app_handle = 0;
-    const esp_partition_t *app_partition = NULL;
-
     ESP_LOGI(TAG, "starting OTA handler");
 
-    const esp_partition_t *running = esp_ota_get_running_partition();
-    esp_ota_img_states_t ota_state;
-    if (esp_ota_get_state_partition(running, &ota_state) == ESP_OK) {
-        if (ota_state == ESP_OTA_IMG_PENDING_VERIFY) {
-            ESP_LOGI(TAG, "marking current running partition subtype %d at offset 0x%08" PRIx32 " as valid",
-                     running->subtype, running->address);
-            esp_ota_mark_app_valid_cancel_rollback();
-        }
+    err = ota_writer_begin(&writer);
+    if (err != ESP_OK) {
+        return ota_post_fail(req, writer.failure);
     }
 
-    app_partition = esp_partition_find_first(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_OTA_0, NULL);
-    ESP_LOGI(TAG, "writing to partition subtype %d at offset 0x%08" PRIx32, app_partition->subtype,
-             app_partition->address);
+    if (req->content_len < OTA_WRITER_HEADER_LEN || req->content_len > writer.partition->size) {
+        ESP_LOGE(TAG, "image size %d does not fit partition", req->content_len);
+        ota_writer_abort(&writer, OTA_FAILURE_INVALID_IMAGE);
+        return ota_post_fail(req, OTA_FAILURE_INVALID_IMAGE);
+    }
 
-    assert(app_partition != NULL);
+    // without PSRAM (or room in it) the upload keeps streaming straight to flash
+    ota_writer_stage(&writer, req->content_len);
 
-    image_header_was_checked = false;
     binary_file_length = 0;
+    buffered = 0;
 
     while (binary_file_length < req->content_len) {
         if (otaserver_event_cb != NULL) {
-            (*otaserver_event_cb)(OTA_EVENT_IDLE);
+            (*otaserver_event_cb)(OTA_EVENT_IDLE, OTA_FAILURE_NONE);
+        }
+
+        reason = ota_writer_check_progress(&writer);
+        if (reason != OTA_FAILURE_NONE) {
+            ota_writer_abort(&writer, reason);
+            return ota_post_fail(req, reason);
         }
 
-        data_read = httpd_req_recv(req, ota_write_data, MIN(req->content_len - binary_file_length, OTA_BUFFSIZE));
+        data_read = httpd_req_recv(req, ota_write_data + buffered,
+                                   MIN(req->content_len - binary_file_length - buffered, OTA_BUFFSIZE - buffered));
 
         if (data_read < 0) {
             if (data_read == HTTPD_SOCK_ERR_TIMEOUT) {
-                // retry receiving if timeout occurred
+                // retry receiving if timeout occurred, the progress check above bounds how long we wait
                 continue;
             }
 
             ESP_LOGE(TAG, "data read error");
-            if (image_header_was_checked) {
-                esp_ota_abort(app_handle);
-            }
-
-            httpd_resp_set_status(req, HTTPD_400);
-            httpd_resp_send(req, NULL, 0);
-
-            if (otaserver_event_cb != NULL) {
-                (*otaserver_event_cb)(OTA_EVENT_FAILED);
-            }
-
-            PM_LOCK_RELEASE();
-            return ESP_FAIL;
+            ota_writer_abort(&writer, OTA_FAILURE_RECV_ERROR);
+            return ota_post_fail(req, OTA_FAILURE_RECV_ERROR);
 
         } else if (data_read > 0) {
-            if (!image_header_was_checked) {
-                esp_app_desc_t new_app_info;
-
-                if (data_read >
-                    sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t) + sizeof(esp_app_desc_t)) {
-                    memcpy(&new_app_info,
-                           &ota_write_data[sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t)],
-                           sizeof(esp_app_desc_t));
-
-                    ESP_LOGI(TAG, "got chunk of size %d, parsing header", data_read);
-
-                    ESP_LOGI(TAG, "new firmware version: %s", new_app_info.version);
-
-                    esp_app_desc_t app_info;
-                    if (esp_ota_get_partition_description(app_partition, &app_info) == ESP_OK) {
-                        ESP_LOGI(TAG, "current firmware version: %s", app_info.version);
-                    }
-
-                    err = esp_ota_begin(app_partition, OTA_WITH_SEQUENTIAL_WRITES, &app_handle);
-                    if (err != ESP_OK) {
-                        ESP_LOGE(TAG, "esp_ota_begin failed (%s)", esp_err_to_name(err));
-
-                        httpd_resp_set_status(req, HTTPD_400);
-                        httpd_resp_send(req, NULL, 0);
-
-                        if (otaserver_event_cb != NULL) {
-                            (*otaserver_event_cb)(OTA_EVENT_FAILED);
-                        }
-
-                        PM_LOCK_RELEASE();
-                        return ESP_FAIL;
-                    }
-
-                    image_header_was_checked = true;
-
-                    ESP_LOGI(TAG, "esp_ota_begin succeeded");
-
-                } else {
-                    ESP_LOGE(TAG, "received package does not fit header length");
-                    esp_ota_abort(app_handle);
+            buffered += data_read;
 
-                    httpd_resp_set_status(req, HTTPD_400);
-                    httpd_resp_send(req, NULL, 0);
-
-                    if (otaserver_event_cb != NULL) {
-                        (*otaserver_event_cb)(OTA_EVENT_FAILED);
-                    }
-
-                    PM_LOCK_RELEASE();
-                    return ESP_FAIL;
-                }
+            // the first write checks the image header, a short read must not cut it in half
+            if (binary_file_length == 0 && buffered < OTA_WRITER_HEADER_LEN) {
+                continue;
             }
 
-            err = esp_ota_write(app_handle, (const void *)ota_write_data, data_read);
-
+            err = ota_writer_write(&writer, ota_write_data, buffered);
             if (err != ESP_OK) {
-                esp_ota_abort(app_handle);
-
-                httpd_resp_set_status(req, HTTPD_500);
-                httpd_resp_send(req, NULL, 0);
-
-                if (otaserver_event_cb != NULL) {
-                    (*otaserver_event_cb)(OTA_EVENT_FAILED);
-                }
-
-                PM_LOCK_RELEASE();
-                return ESP_FAIL;
+                return ota_post_fail(req, writer.failure);
             }
 
-            binary_file_length += data_read;
-            ESP_LOGD(TAG, "written image length %d", binary_file_length);
+            binary_file_length += buffered;
+            buffered = 0;
 
         } else if (data_read == 0) {
             ESP_LOGE(TAG, "connection closed");
-            if (image_header_was_checked) {
-                esp_ota_abort(app_handle);
-            }
-
-            httpd_resp_set_status(req, HTTPD_400);
-            httpd_resp_send(req, NULL, 0);
-
-            if (otaserver_event_cb != NULL) {
-                (*otaserver_event_cb)(OTA_EVENT_FAILED);
-            }
-
-            PM_LOCK_RELEASE();
-            return ESP_FAIL;
+            ota_writer_abort(&writer, OTA_FAILURE_SHORT_BODY);
+            return ota_post_fail(req, OTA_FAILURE_SHORT_BODY);
         }
     }
-    ESP_LOGI(TAG, "total write binary data length: %d", binary_file_length);
 
     if (otaserver_event_cb != NULL) {
-        (*otaserver_event_cb)(OTA_EVENT_IDLE);
+        (*otaserver_event_cb)(OTA_EVENT_IDLE, OTA_FAILURE_NONE);
     }
 
-    err = esp_ota_end(app_handle);
+    err = ota_writer_end(&writer, NULL);
     if (err != ESP_OK) {
-        if (err == ESP_ERR_OTA_VALIDATE_FAILED) {
-            ESP_LOGE(TAG, "image validation failed, image is corrupted");
-        }
-        ESP_LOGE(TAG, "esp_ota_end failed (%s)!", esp_err_to_name(err));
-
-        httpd_resp_set_status(req, HTTPD_400);
-        httpd_resp_send(req, NULL, 0);
-
-        if (otaserver_event_cb != NULL) {
-            (*otaserver_event_cb)(OTA_EVENT_FAILED);
-        }
-
-        PM_LOCK_RELEASE();
-        return ESP_FAIL;
+        return ota_post_fail(req, writer.failure);
     }
 
     if (otaserver_event_cb != NULL) {
-        (*otaserver_event_cb)(OTA_EVENT_IDLE);
+        (*otaserver_event_cb)(OTA_EVENT_IDLE, OTA_FAILURE_NONE);
     }
 
-    err = esp_ota_set_boot_partition(app_partition);
+    err = ota_writer_activate(&writer);
     if (err != ESP_OK) {
-        ESP_LOGE(TAG, "esp_ota_set_boot_partition failed (%s)!", esp_err_to_name(err));
-
-        httpd_resp_set_status(req, HTTPD_500);
-        httpd_resp_send(req, NULL, 0);
-
-        if (otaserver_event_cb != NULL) {
-            (*otaserver_event_cb)(OTA_EVENT_FAILED);
-        }
-
-        PM_LOCK_RELEASE();
-        return ESP_FAIL;
+        return ota_post_fail(req, writer.failure);
     }
 
     httpd_resp_set_status(req, HTTPD_202);
     httpd_resp_send(req, NULL, 0);
 
     if (otaserver_event_cb != NULL) {
-        (*otaserver_event_cb)(OTA_EVENT_SUCCESS);
+        (*otaserver_event_cb)(OTA_EVENT_SUCCESS, OTA_FAILURE_NONE);
     }
 
     ESP_LOGI(TAG, "prepare to system restart");
@@ -330,7 +332,7 @@ esp_err_t reboot_post_handler(httpd_req_t *req) {
         httpd_resp_send(req, NULL, 0);
 
         if (otaserver_event_cb != NULL) {
-            (*otaserver_event_cb)(OTA_EVENT_FAILED);
+            (*otaserver_event_cb)(OTA_EVENT_FAILED, OTA_FAILURE_FLASH_ERROR);
         }
 
         PM_LOCK_RELEASE();
@@ -341,7 +343,7 @@ esp_err_t reboot_post_handler(httpd_req_t *req) {
     httpd_resp_send(req, NULL, 0);
 
     if (otaserver_event_cb != NULL) {
-        (*otaserver_event_cb)(OTA_EVENT_REBOOT);
+        (*otaserver_event_cb)(OTA_EVENT_REBOOT, OTA_FAILURE_NONE);
     }
 
     ESP_LOGI(TAG, "prepare to system restart");
@@ -356,7 +358,7 @@ esp_err_t index_get_handler(httpd_req_t *req) {
     PM_LOCK_ACQUIRE();
 
     if (otaserver_event_cb != NULL) {
-        (*otaserver_event_cb)(OTA_EVENT_IDLE);
+        (*otaserver_event_cb)(OTA_EVENT_IDLE, OTA_FAILURE_NONE);
     }
 
     httpd_resp_set_type(req, "text/html");
@@ -381,7 +383,7 @@ esp_err_t coredump_get_handler(httpd_req_t *req) {
     PM_LOCK_ACQUIRE();
 
     if (otaserver_event_cb != NULL) {
-        (*otaserver_event_cb)(OTA_EVENT_IDLE);
+        (*otaserver_event_cb)(OTA_EVENT_IDLE, OTA_FAILURE_NONE);
     }
 
     ESP_LOGI(TAG, "starting coredump handler");
@@ -438,7 +440,7 @@ esp_err_t coredump_get_handler(httpd_req_t *req) {
         data_read += chunk_size;
 
         if (otaserver_event_cb != NULL) {
-            (*otaserver_event_cb)(OTA_EVENT_IDLE);
+            (*otaserver_event_cb)(OTA_EVENT_IDLE, OTA_FAILURE_NONE);
         }
     }
 
@@ -450,6 +452,352 @@ esp_err_t coredump_get_handler(httpd_req_t *req) {
     return ESP_OK;
 }
 
+// parse a single "bytes=first-last" range, returns ESP_ERR_INVALID_SIZE when it starts past the end and
+// ESP_ERR_INVALID_ARG for anything to be ignored (malformed, reversed or more than one range)
+static esp_err_t partition_parse_range(const char *range, size_t len, size_t *first, size_t *last) {
+    unsigned long a, b;
+
+    if (strncmp(range, "bytes=", 6) != 0 || strchr(range, ',') != NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    range += 6;
+
+    if (sscanf(range, "-%lu", &b) == 1) {
+        // suffix range, last b bytes
+        if (b == 0) {
+            return ESP_ERR_INVALID_SIZE;
+        }
+
+        *first = b < len ? len - b : 0;
+        *last = len - 1;
+
+    } else if (sscanf(range, "%lu-%lu", &a, &b) == 2) {
+        if (a > b) {
+            return ESP_ERR_INVALID_ARG;
+        }
+
+        *first = a;
+        *last = b < len ? b : len - 1;
+
+    } else if (sscanf(range, "%lu-", &a) == 1) {
+        *first = a;
+        *last = len - 1;
+
+    } else {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    return *first < len ? ESP_OK : ESP_ERR_INVALID_SIZE;
+}
+
+esp_err_t partition_get_handler(httpd_req_t *req) {
+    esp_err_t err;
+
+    size_t image_len;
+    size_t first, last;
+
+    const void *map_ptr;
+    spi_flash_mmap_handle_t map_handle;
+
+    esp_image_metadata_t metadata;
+    uint8_t sha256[32];
+
+    char etag[sizeof(sha256) * 2 + 3];
+    char if_none_match[sizeof(etag)];
+    char range[48];
+    char content_range[48];
+
+    uint8_t i;
+
+    PM_LOCK_ACQUIRE();
+
+    if (otaserver_event_cb != NULL) {
+        (*otaserver_event_cb)(OTA_EVENT_IDLE, OTA_FAILURE_NONE);
+    }
+
+    ESP_LOGI(TAG, "starting partition handler");
+
+    const esp_partition_t *partition =
+        esp_partition_find_first(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_OTA_0, NULL);
+    assert(partition != NULL);
+
+    // the image is usually much smaller than the partition, only send what the segment headers cover
+    const esp_partition_pos_t partition_pos = {.offset = partition->address, .size = partition->size};
+    if (esp_image_get_metadata(&partition_pos, &metadata) != ESP_OK ||
+        esp_partition_get_sha256(partition, sha256) != ESP_OK) {
+        ESP_LOGE(TAG, "no valid image in app partition");
+
+        httpd_resp_set_status(req, HTTPD_404);
+        httpd_resp_send(req, NULL, 0);
+
+        PM_LOCK_RELEASE();
+        return ESP_OK;
+    }
+
+    image_len = metadata.image_len;
+
+    etag[0] = '"';
+    for (i = 0; i < sizeof(sha256); i++) {
+        snprintf(&etag[1 + i * 2], 3, "%02x", sha256[i]);
+    }
+    strcpy(&etag[1 + sizeof(sha256) * 2], "\"");
+
+    httpd_resp_set_type(req, "application/octet-stream");
+    httpd_resp_set_hdr(req, "Content-Disposition", "attachment; filename=\"ota_0.bin\"");
+    httpd_resp_set_hdr(req, "Accept-Ranges", "bytes");
+    httpd_resp_set_hdr(req, "ETag", etag);
+
+    if (httpd_req_get_hdr_value_str(req, "If-None-Match", if_none_match, sizeof(if_none_match)) == ESP_OK &&
+        strcmp(if_none_match, etag) == 0) {
+        httpd_resp_set_status(req, HTTPD_304);
+        httpd_resp_send(req, NULL, 0);
+
+        PM_LOCK_RELEASE();
+        return ESP_OK;
+    }
+
+    first = 0;
+    last = image_len - 1;
+
+    // a Range header that is too long, malformed or asks for more than one range is ignored (RFC 9110 14.2) and
+    // answered with the whole image
+    err = ESP_ERR_NOT_FOUND;
+    if (httpd_req_get_hdr_value_str(req, "Range", range, sizeof(range)) == ESP_OK) {
+        err = partition_parse_range(range, image_len, &first, &last);
+    }
+
+    if (err == ESP_ERR_INVALID_SIZE) {
+        snprintf(content_range, sizeof(content_range), "bytes */%d", image_len);
+        httpd_resp_set_hdr(req, "Content-Range", content_range);
+
+        httpd_resp_set_status(req, HTTPD_416);
+        httpd_resp_send(req, NULL, 0);
+
+        PM_LOCK_RELEASE();
+        return ESP_OK;
+
+    } else if (err == ESP_OK) {
+        snprintf(content_range, sizeof(content_range), "bytes %d-%d/%d", first, last, image_len);
+        httpd_resp_set_hdr(req, "Content-Range", content_range);
+        httpd_resp_set_status(req, HTTPD_206);
+
+    } else {
+        httpd_resp_set_status(req, HTTPD_200);
+    }
+
+    // map the image to data memory
+    err = esp_partition_mmap(partition, 0, image_len, SPI_FLASH_MMAP_DATA, &map_ptr, &map_handle);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "unable to mmap app partition");
+
+        httpd_resp_set_status(req, HTTPD_500);
+        httpd_resp_send(req, NULL, 0);
+
+        PM_LOCK_RELEASE();
+        return ESP_FAIL;
+    }
+
+    // send straight from the mapping, httpd_resp_send also sets Content-Length
+    err = httpd_resp_send(req, (const char *)map_ptr + first, last - first + 1);
+
+    spi_flash_munmap(map_handle);
+
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "http write error");
+
+        PM_LOCK_RELEASE();
+        return ESP_FAIL;
+    }
+
+    PM_LOCK_RELEASE();
+
+    return ESP_OK;
+}
+
+static uint32_t logs_get_since(httpd_req_t *req) {
+    char query[32];
+    char value[12];
+    uint32_t since;
+
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK &&
+        httpd_query_key_value(query, "since", value, sizeof(value)) == ESP_OK) {
+        since = strtoul(value, NULL, 10);
+
+        // sequence numbers restart with every boot, a client resuming from before the restart gets what is held
+        if (since <= logbuf_head()) {
+            return since;
+        }
+    }
+
+    return logbuf_tail();
+}
+
+// send buffered lines starting at *seq, stops at the first line not yet committed
+static esp_err_t logs_send_lines(httpd_req_t *req, uint32_t *seq) {
+    esp_err_t err;
+    int ret;
+    uint32_t prev_seq;
+
+    char line[LOGBUF_LINE_SIZE];
+    char logs_write_data[LOGBUF_LINE_SIZE + 16];
+
+    while (true) {
+        prev_seq = *seq;
+        ret = logbuf_read(seq, line, sizeof(line));
+
+        if (ret == LOGBUF_READ_EMPTY) {
+            return ESP_OK;
+
+        } else if (ret == LOGBUF_READ_GAP) {
+            snprintf(logs_write_data, sizeof(logs_write_data), "%08" PRIu32 " -- %" PRIu32 " lines lost --\n",
+                     prev_seq, *seq - prev_seq);
+
+        } else {
+            snprintf(logs_write_data, sizeof(logs_write_data), "%08" PRIu32 " %s\n", prev_seq, line);
+        }
+
+        err = httpd_resp_sendstr_chunk(req, logs_write_data);
+        if (err != ESP_OK) {
+            return err;
+        }
+    }
+}
+
+esp_err_t logs_get_handler(httpd_req_t *req) {
+    esp_err_t err;
+    uint32_t seq;
+
+    PM_LOCK_ACQUIRE();
+
+    if (otaserver_event_cb != NULL) {
+        (*otaserver_event_cb)(OTA_EVENT_IDLE, OTA_FAILURE_NONE);
+    }
+
+    seq = logs_get_since(req);
+
+    httpd_resp_set_status(req, HTTPD_200);
+    httpd_resp_set_type(req, "text/plain");
+
+    err = logs_send_lines(req, &seq);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "http write error");
+
+        PM_LOCK_RELEASE();
+        return ESP_FAIL;
+    }
+
+    httpd_resp_send_chunk(req, NULL, 0);
+
+    PM_LOCK_RELEASE();
+
+    return ESP_OK;
+}
+
+// the stream only writes when there is a new line, so look for a closed connection while idle
+static bool logs_stream_peer_alive(httpd_req_t *req) {
+    char c;
+    ssize_t ret;
+
+    ret = recv(httpd_req_to_sockfd(req), &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    if (ret == 0) {
+        return false;
+    }
+
+    return ret > 0 || errno == EAGAIN || errno == EWOULDBLOCK;
+}
+
+void logs_stream_task(void *pvParameter) {
+    httpd_req_t *req = (httpd_req_t *)pvParameter;
+    uint32_t seq;
+
+    seq = logs_get_since(req);
+
+    httpd_resp_set_status(req, HTTPD_200);
+    httpd_resp_set_type(req, "text/plain");
+
+    // runs until the client goes away, so it stays off the httpd task
+    while (logs_send_lines(req, &seq) == ESP_OK && logs_stream_peer_alive(req)) {
+        vTaskDelay(LOGS_STREAM_POLL_TICKS);
+    }
+
+    ESP_LOGI(TAG, "log stream closed");
+
+    httpd_req_async_handler_complete(req);
+    logs_streaming = false;
+
+    vTaskDelete(NULL);
+}
+
+esp_err_t logs_stream_get_handler(httpd_req_t *req) {
+    esp_err_t err;
+    httpd_req_t *async_req;
+
+    PM_LOCK_ACQUIRE();
+
+    if (otaserver_event_cb != NULL) {
+        (*otaserver_event_cb)(OTA_EVENT_IDLE, OTA_FAILURE_NONE);
+    }
+
+    if (logs_streaming) {
+        ESP_LOGW(TAG, "log stream already active");
+
+        httpd_resp_set_status(req, HTTPD_503);
+        httpd_resp_send(req, NULL, 0);
+
+        PM_LOCK_RELEASE();
+        return ESP_OK;
+    }
+
+    err = httpd_req_async_handler_begin(req, &async_req);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "httpd_req_async_handler_begin failed (%s)", esp_err_to_name(err));
+
+        httpd_resp_set_status(req, HTTPD_500);
+        httpd_resp_send(req, NULL, 0);
+
+        PM_LOCK_RELEASE();
+        return ESP_FAIL;
+    }
+
+    logs_streaming = true;
+
+    if (xTaskCreate(logs_stream_task, "logs_stream_task", 4096, async_req, 5, NULL) != pdPASS) {
+        ESP_LOGE(TAG, "unable to start log stream task");
+
+        logs_streaming = false;
+
+        httpd_resp_set_status(async_req, HTTPD_500);
+        httpd_resp_send(async_req, NULL, 0);
+        httpd_req_async_handler_complete(async_req);
+
+        PM_LOCK_RELEASE();
+        return ESP_FAIL;
+    }
+
+    PM_LOCK_RELEASE();
+
+    return ESP_OK;
+}
+
+esp_err_t metrics_get_handler(httpd_req_t *req) {
+    char metrics_data[METRICS_BUFFSIZE];
+
+    PM_LOCK_ACQUIRE();
+
+    if (otaserver_event_cb != NULL) {
+        (*otaserver_event_cb)(OTA_EVENT_IDLE, OTA_FAILURE_NONE);
+    }
+
+    metrics_format(metrics_data, sizeof(metrics_data));
+
+    httpd_resp_set_type(req, "text/plain");
+    httpd_resp_sendstr(req, metrics_data);
+
+    PM_LOCK_RELEASE();
+
+    return ESP_OK;
+}
+
 static const httpd_uri_t root_uri = {.uri = "/", .method = HTTP_GET, .handler = index_get_handler, .user_ctx = NULL};
 
 static const httpd_uri_t index_html_uri = {
@@ -466,8 +814,21 @@ static const httpd_uri_t reboot_uri = {
 static const httpd_uri_t coredump_uri = {
     .uri = "/coredump", .method = HTTP_GET, .handler = coredump_get_handler, .user_ctx = NULL};
 
-static const httpd_uri_t *uri_handlers[] = {&root_uri, &index_html_uri, &index_htm_uri,
-                                            &ota_uri,  &reboot_uri,     &coredump_uri};
+static const httpd_uri_t partition_uri = {
+    .uri = "/partition/ota_0", .method = HTTP_GET, .handler = partition_get_handler, .user_ctx = NULL};
+
+static const httpd_uri_t logs_uri = {
+    .uri = "/logs", .method = HTTP_GET, .handler = logs_get_handler, .user_ctx = NULL};
+
+static const httpd_uri_t logs_stream_uri = {
+    .uri = "/logs/stream", .method = HTTP_GET, .handler = logs_stream_get_handler, .user_ctx = NULL};
+
+static const httpd_uri_t metrics_uri = {
+    .uri = "/metrics", .method = HTTP_GET, .handler = metrics_get_handler, .user_ctx = NULL};
+
+static const httpd_uri_t *uri_handlers[] = {&root_uri,        &index_html_uri, &index_htm_uri, &ota_uri,
+                                            &reboot_uri,      &coredump_uri,   &partition_uri, &logs_uri,
+                                            &logs_stream_uri, &metrics_uri};
 
 void esp_restart_task(void *pvParameter) {
     vTaskDelay(OTA_RESTART_DELAY_TICKS);
@@ -493,6 +854,8 @@ esp_err_t otaserver_start(otaserver_event_cb_t event_cb) {
 
     config.stack_size = 8 * 1024;
     config.lru_purge_enable = true;
+    config.max_open_sockets = OTASERVER_MAX_OPEN_SOCKETS;
+    config.max_uri_handlers = ARRAY_LEN(uri_handlers);
 
     ESP_LOGI(TAG, "starting server on port: '%d'", config.server_port);
     err = httpd_start(&otaserver, &config);
@@ -8,6 +8,9 @@ extern "C" {
 
 #define OTA_BUFFSIZE 1024
 
+// attempts made by the web UI before giving up on an upload
+#define OTA_UPLOAD_RETRIES 3
+
 #define OTA_RESTART_DELAY_MS (3000)
 #define OTA_RESTART_DELAY_TICKS (pdMS_TO_TICKS(OTA_RESTART_DELAY_MS))
 
@@ -17,13 +20,49 @@ extern "C" {
 #define OTA_EVENT_REBOOT 3
 #define OTA_EVENT_FAILED 4
 
-#define HTTPD_202 "202 Accepted" /*!< HTTP Response 202 */
+#define OTA_FAILURE_NONE 0
+#define OTA_FAILURE_STALL 1
+#define OTA_FAILURE_SLOW_CLIENT 2
+#define OTA_FAILURE_SHORT_BODY 3
+#define OTA_FAILURE_RECV_ERROR 4
+#define OTA_FAILURE_FLASH_ERROR 5
+#define OTA_FAILURE_INVALID_IMAGE 6
+#define OTA_FAILURE_BUSY 7
+#define OTA_FAILURE_COUNT 8
+
+// abort an upload when nothing was written for this long
+#define OTA_STALL_TIMEOUT_MS (20000)
+
+// abort an upload averaging less than OTA_THROUGHPUT_MIN_BPS over a window of OTA_THROUGHPUT_WINDOW_MS
+#define OTA_THROUGHPUT_WINDOW_MS (15000)
+#define OTA_THROUGHPUT_MIN_BPS (2048)
+
+// the throughput is judged when data arrives, after this long without any the stall timeout takes over
+#define OTA_THROUGHPUT_IDLE_MS (1000)
+
+// lwIP sockets held outside httpd: the raw TCP listener, its client and the multicast receiver
+#define OTA_EXTRA_SOCKETS 3
 
-typedef void (*otaserver_event_cb_t)(uint8_t);
+// httpd keeps 3 sockets of its own next to its sessions, leave room in CONFIG_LWIP_MAX_SOCKETS for the others so
+// neither side runs into ENFILE and LRU purging kicks in before the pool is exhausted
+#define OTASERVER_MAX_OPEN_SOCKETS (CONFIG_LWIP_MAX_SOCKETS - 3 - OTA_EXTRA_SOCKETS)
+
+#define LOGS_STREAM_POLL_MS (250)
+#define LOGS_STREAM_POLL_TICKS (pdMS_TO_TICKS(LOGS_STREAM_POLL_MS))
+
+#define HTTPD_202 "202 Accepted"              /*!< HTTP Response 202 */
+#define HTTPD_206 "206 Partial Content"       /*!< HTTP Response 206 */
+#define HTTPD_304 "304 Not Modified"          /*!< HTTP Response 304 */
+#define HTTPD_416 "416 Range Not Satisfiable" /*!< HTTP Response 416 */
+#define HTTPD_503 "503 Service Unavailable"   /*!< HTTP Response 503 */
+
+typedef void (*otaserver_event_cb_t)(uint8_t event, uint8_t reason);
 
 esp_err_t otaserver_start(otaserver_event_cb_t);
 esp_err_t otaserver_stop(void);
 
+void esp_restart_task(void *pvParameter);
+
 #ifdef __cplusplus
 }
 #endif
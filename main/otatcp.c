@@ -0,0 +1,305 @@
+#include "otatcp.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/param.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "lwip/sockets.h"
+#include "metrics.h"
+#include "otawriter.h"
+
+#define TAG "otatcp"
+
+// Protocol, one update per connection:
+//   client: "OTA <size> <sha256 hex> [ota_0]\n"
+//   server: "OK\n" or "ERR <reason>\n", see metrics_failure_name() for reasons
+//   client: <size> bytes of raw image
+//   server: "OK\n" once the image is verified and set as boot partition, "ERR <reason>\n" otherwise
+
+static otaserver_event_cb_t otatcp_event_cb;
+static char otatcp_write_data[OTA_TCP_BUFFSIZE];
+
+static void otatcp_reply(int sock, const char *reply) { send(sock, reply, strlen(reply), 0); }
+
+static esp_err_t otatcp_fail(int sock, uint8_t reason) {
+    char reply[32];
+
+    snprintf(reply, sizeof(reply), "ERR %s\n", metrics_failure_name(reason));
+    otatcp_reply(sock, reply);
+
+    if (otatcp_event_cb != NULL) {
+        (*otatcp_event_cb)(OTA_EVENT_FAILED, reason);
+    }
+
+    return ESP_FAIL;
+}
+
+static esp_err_t otatcp_read_line(int sock, char *line, size_t size) {
+    size_t len = 0;
+    ssize_t data_read;
+    char c;
+
+    int64_t start_us = esp_timer_get_time();
+
+    while (len < size - 1) {
+        data_read = recv(sock, &c, 1, 0);
+
+        if (data_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (esp_timer_get_time() - start_us > OTA_STALL_TIMEOUT_MS * 1000LL) {
+                return ESP_ERR_TIMEOUT;
+            }
+
+            continue;
+
+        } else if (data_read != 1) {
+            return ESP_FAIL;
+        }
+
+        if (c == '\n') {
+            if (len > 0 && line[len - 1] == '\r') {
+                len--;
+            }
+
+            line[len] = '\0';
+            return ESP_OK;
+        }
+
+        line[len++] = c;
+    }
+
+    return ESP_ERR_INVALID_SIZE;
+}
+
+// receive exactly len bytes, returns the OTA_FAILURE_* reason when that is not going to happen
+static uint8_t otatcp_read_full(int sock, ota_writer_t *writer, char *buf, size_t len) {
+    ssize_t data_read;
+    size_t received = 0;
+    uint8_t reason;
+
+    while (received < len) {
+        reason = ota_writer_check_progress(writer);
+        if (reason != OTA_FAILURE_NONE) {
+            return reason;
+        }
+
+        data_read = recv(sock, buf + received, len - received, 0);
+
+        if (data_read < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                // retry receiving if timeout occurred, the progress check above bounds how long we wait
+                continue;
+            }
+
+            ESP_LOGE(TAG, "data read error (errno %d)", errno);
+            return OTA_FAILURE_RECV_ERROR;
+
+        } else if (data_read == 0) {
+            ESP_LOGE(TAG, "connection closed");
+            return OTA_FAILURE_SHORT_BODY;
+        }
+
+        received += data_read;
+    }
+
+    return OTA_FAILURE_NONE;
+}
+
+static bool otatcp_parse_sha256(const char *hex, uint8_t *sha256) {
+    size_t i;
+    unsigned int byte;
+
+    if (strlen(hex) != OTA_WRITER_SHA256_LEN * 2) {
+        return false;
+    }
+
+    for (i = 0; i < OTA_WRITER_SHA256_LEN; i++) {
+        if (sscanf(&hex[i * 2], "%2x", &byte) != 1) {
+            return false;
+        }
+
+        sha256[i] = byte;
+    }
+
+    return true;
+}
+
+static esp_err_t otatcp_handle_client(int sock) {
+    esp_err_t err;
+    ota_writer_t writer;
+    uint8_t reason;
+
+    char header[OTA_TCP_HEADER_MAXLEN];
+    char sha256_hex[OTA_WRITER_SHA256_LEN * 2 + 1];
+    char target[16] = "ota_0";
+    uint8_t sha256[OTA_WRITER_SHA256_LEN];
+
+    unsigned long image_len;
+    size_t binary_file_length;
+    size_t chunk_size;
+
+    err = otatcp_read_line(sock, header, sizeof(header));
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "unable to read header");
+        otatcp_reply(sock, "ERR header\n");
+        return err;
+    }
+
+    if (sscanf(header, "OTA %lu %64s %15s", &image_len, sha256_hex, target) < 2 ||
+        !otatcp_parse_sha256(sha256_hex, sha256)) {
+        ESP_LOGE(TAG, "malformed header");
+        otatcp_reply(sock, "ERR header\n");
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (strcmp(target, "ota_0") != 0) {
+        ESP_LOGE(TAG, "unsupported target %s", target);
+        otatcp_reply(sock, "ERR target\n");
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (otatcp_event_cb != NULL) {
+        (*otatcp_event_cb)(OTA_EVENT_BEGIN, OTA_FAILURE_NONE);
+    }
+
+    ESP_LOGI(TAG, "starting OTA of %lu bytes", image_len);
+
+    err = ota_writer_begin(&writer);
+    if (err != ESP_OK) {
+        return otatcp_fail(sock, writer.failure);
+    }
+
+    if (image_len < OTA_WRITER_HEADER_LEN || image_len > writer.partition->size) {
+        ESP_LOGE(TAG, "image size %lu does not fit partition", image_len);
+        ota_writer_abort(&writer, OTA_FAILURE_INVALID_IMAGE);
+        return otatcp_fail(sock, OTA_FAILURE_INVALID_IMAGE);
+    }
+
+    // without PSRAM (or room in it) the image keeps streaming straight to flash
+    ota_writer_stage(&writer, image_len);
+
+    otatcp_reply(sock, "OK\n");
+
+    binary_file_length = 0;
+
+    while (binary_file_length < image_len) {
+        if (otatcp_event_cb != NULL) {
+            (*otatcp_event_cb)(OTA_EVENT_IDLE, OTA_FAILURE_NONE);
+        }
+
+        chunk_size = MIN(image_len - binary_file_length, OTA_TCP_BUFFSIZE);
+
+        reason = otatcp_read_full(sock, &writer, otatcp_write_data, chunk_size);
+        if (reason != OTA_FAILURE_NONE) {
+            ota_writer_abort(&writer, reason);
+            return otatcp_fail(sock, reason);
+        }
+
+        err = ota_writer_write(&writer, otatcp_write_data, chunk_size);
+        if (err != ESP_OK) {
+            return otatcp_fail(sock, writer.failure);
+        }
+
+        binary_file_length += chunk_size;
+    }
+
+    if (otatcp_event_cb != NULL) {
+        (*otatcp_event_cb)(OTA_EVENT_IDLE, OTA_FAILURE_NONE);
+    }
+
+    err = ota_writer_end(&writer, sha256);
+    if (err != ESP_OK) {
+        return otatcp_fail(sock, writer.failure);
+    }
+
+    err = ota_writer_activate(&writer);
+    if (err != ESP_OK) {
+        return otatcp_fail(sock, writer.failure);
+    }
+
+    otatcp_reply(sock, "OK\n");
+
+    return ESP_OK;
+}
+
+static void otatcp_task(void *pvParameter) {
+    esp_err_t err;
+    int listen_sock = (int)(intptr_t)pvParameter;
+    int sock;
+
+    struct timeval timeout = {
+        .tv_sec = OTA_TCP_RECV_TIMEOUT_MS / 1000,
+        .tv_usec = (OTA_TCP_RECV_TIMEOUT_MS % 1000) * 1000,
+    };
+
+    while (true) {
+        sock = accept(listen_sock, NULL, NULL);
+        if (sock < 0) {
+            ESP_LOGE(TAG, "accept failed (errno %d)", errno);
+            continue;
+        }
+
+        ESP_LOGI(TAG, "client connected");
+
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+        err = otatcp_handle_client(sock);
+
+        shutdown(sock, SHUT_RDWR);
+        close(sock);
+
+        if (err != ESP_OK) {
+            continue;
+        }
+
+        if (otatcp_event_cb != NULL) {
+            (*otatcp_event_cb)(OTA_EVENT_SUCCESS, OTA_FAILURE_NONE);
+        }
+
+        ESP_LOGI(TAG, "prepare to system restart");
+        xTaskCreate(esp_restart_task, "esp_restart_task", 1024, NULL, 5, NULL);
+    }
+}
+
+esp_err_t otatcp_start(otaserver_event_cb_t event_cb) {
+    int listen_sock;
+    int opt = 1;
+
+    otatcp_event_cb = event_cb;
+
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(OTA_TCP_PORT),
+        .sin_addr.s_addr = htonl(INADDR_ANY),
+    };
+
+    listen_sock = socket(AF_INET, SOCK_STREAM, IPPROTO_IP);
+    if (listen_sock < 0) {
+        ESP_LOGE(TAG, "unable to create socket (errno %d)", errno);
+        return ESP_FAIL;
+    }
+
+    setsockopt(listen_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+    if (bind(listen_sock, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(listen_sock, 1) != 0) {
+        ESP_LOGE(TAG, "unable to listen on port %d (errno %d)", OTA_TCP_PORT, errno);
+
+        close(listen_sock);
+        return ESP_FAIL;
+    }
+
+    ESP_LOGI(TAG, "listening on port: '%d'", OTA_TCP_PORT);
+
+    if (xTaskCreate(otatcp_task, "otatcp_task", 4096, (void *)(intptr_t)listen_sock, 5, NULL) != pdPASS) {
+        ESP_LOGE(TAG, "unable to start server task");
+
+        close(listen_sock);
+        return ESP_ERR_NO_MEM;
+    }
+
+    return ESP_OK;
+}
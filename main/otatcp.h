@@ -0,0 +1,19 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "esp_err.h"
+#include "otaserver.h"
+
+#define OTA_TCP_PORT 3232
+#define OTA_TCP_BUFFSIZE 4096
+#define OTA_TCP_HEADER_MAXLEN 128
+#define OTA_TCP_RECV_TIMEOUT_MS (1000)
+
+esp_err_t otatcp_start(otaserver_event_cb_t);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,427 @@
+#include "otawriter.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <sys/param.h>
+
+#include "esp_heap_caps.h"
+#include "metrics.h"
+#include "spi_flash_mmap.h"
+
+#define TAG "otawriter"
+
+static atomic_bool ota_writer_busy;
+
+static void ota_writer_release(ota_writer_t *writer) {
+    if (!writer->claimed) {
+        return;
+    }
+
+    mbedtls_sha256_free(&writer->sha256_ctx);
+    writer->claimed = false;
+
+    if (writer->staging != NULL) {
+        heap_caps_free(writer->staging);
+        writer->staging = NULL;
+    }
+
+    atomic_store(&ota_writer_busy, false);
+}
+
+bool ota_writer_is_busy(void) { return atomic_load(&ota_writer_busy); }
+
+esp_err_t ota_writer_begin(ota_writer_t *writer) {
+    memset(writer, 0, sizeof(*writer));
+
+    if (atomic_exchange(&ota_writer_busy, true)) {
+        ESP_LOGE(TAG, "another OTA session is in progress");
+
+        writer->failure = OTA_FAILURE_BUSY;
+        metrics_ota_result(OTA_FAILURE_BUSY, 0, 0);
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    writer->claimed = true;
+    writer->begin_us = esp_timer_get_time();
+    writer->last_progress_us = writer->begin_us;
+    writer->window_start_us = writer->begin_us;
+
+    metrics_ota_begin();
+
+    const esp_partition_t *running = esp_ota_get_running_partition();
+    esp_ota_img_states_t ota_state;
+    if (esp_ota_get_state_partition(running, &ota_state) == ESP_OK) {
+        if (ota_state == ESP_OTA_IMG_PENDING_VERIFY) {
+            ESP_LOGI(TAG, "marking current running partition subtype %d at offset 0x%08" PRIx32 " as valid",
+                     running->subtype, running->address);
+            esp_ota_mark_app_valid_cancel_rollback();
+        }
+    }
+
+    writer->partition = esp_partition_find_first(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_OTA_0, NULL);
+    assert(writer->partition != NULL);
+
+    ESP_LOGI(TAG, "writing to partition subtype %d at offset 0x%08" PRIx32, writer->partition->subtype,
+             writer->partition->address);
+
+    mbedtls_sha256_init(&writer->sha256_ctx);
+    mbedtls_sha256_starts(&writer->sha256_ctx, 0);
+
+    return ESP_OK;
+}
+
+static esp_err_t ota_writer_check_header(ota_writer_t *writer, const void *data, size_t len) {
+    esp_err_t err;
+    esp_app_desc_t new_app_info;
+
+    if (len < OTA_WRITER_HEADER_LEN) {
+        ESP_LOGE(TAG, "received package does not fit header length");
+        ota_writer_abort(writer, OTA_FAILURE_INVALID_IMAGE);
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    memcpy(&new_app_info, (const uint8_t *)data + sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t),
+           sizeof(esp_app_desc_t));
+
+    ESP_LOGI(TAG, "got chunk of size %d, parsing header", len);
+
+    ESP_LOGI(TAG, "new firmware version: %s", new_app_info.version);
+
+    esp_app_desc_t app_info;
+    if (esp_ota_get_partition_description(writer->partition, &app_info) == ESP_OK) {
+        ESP_LOGI(TAG, "current firmware version: %s", app_info.version);
+    }
+
+    err = esp_ota_begin(writer->partition, OTA_WITH_SEQUENTIAL_WRITES, &writer->handle);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "esp_ota_begin failed (%s)", esp_err_to_name(err));
+        ota_writer_abort(writer, OTA_FAILURE_FLASH_ERROR);
+        return err;
+    }
+
+    writer->header_checked = true;
+
+    ESP_LOGI(TAG, "esp_ota_begin succeeded");
+
+    return ESP_OK;
+}
+
+static void ota_writer_progress(ota_writer_t *writer, size_t len) {
+    writer->written += len;
+    writer->last_progress_us = esp_timer_get_time();
+}
+
+bool ota_writer_stage(ota_writer_t *writer, size_t image_len) {
+#ifdef CONFIG_SPIRAM
+    if (image_len < OTA_WRITER_HEADER_LEN || image_len > writer->partition->size) {
+        return false;
+    }
+
+    writer->staging = heap_caps_malloc(image_len, MALLOC_CAP_SPIRAM);
+    if (writer->staging == NULL) {
+        ESP_LOGI(TAG, "not enough PSRAM to stage %d bytes, streaming to flash", image_len);
+        return false;
+    }
+
+    writer->image_len = image_len;
+
+    ESP_LOGI(TAG, "staging %d bytes in PSRAM", image_len);
+
+    return true;
+#else
+    return false;
+#endif
+}
+
+static esp_err_t ota_writer_write_staging(ota_writer_t *writer, const void *data, size_t len) {
+    if (writer->written + len > writer->image_len) {
+        ESP_LOGE(TAG, "image larger than announced");
+        ota_writer_abort(writer, OTA_FAILURE_INVALID_IMAGE);
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    memcpy(writer->staging + writer->written, data, len);
+    mbedtls_sha256_update(&writer->sha256_ctx, data, len);
+
+    ota_writer_progress(writer, len);
+
+    return ESP_OK;
+}
+
+esp_err_t ota_writer_write(ota_writer_t *writer, const void *data, size_t len) {
+    esp_err_t err;
+
+    if (writer->staging != NULL) {
+        return ota_writer_write_staging(writer, data, len);
+    }
+
+    if (!writer->header_checked) {
+        err = ota_writer_check_header(writer, data, len);
+        if (err != ESP_OK) {
+            return err;
+        }
+    }
+
+    err = esp_ota_write(writer->handle, data, len);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "esp_ota_write failed (%s)", esp_err_to_name(err));
+        ota_writer_abort(writer, OTA_FAILURE_FLASH_ERROR);
+        return err;
+    }
+
+    mbedtls_sha256_update(&writer->sha256_ctx, data, len);
+
+    ota_writer_progress(writer, len);
+    ESP_LOGD(TAG, "written image length %d", writer->written);
+
+    return ESP_OK;
+}
+
+esp_err_t ota_writer_prepare(ota_writer_t *writer, size_t image_len) {
+    esp_err_t err;
+
+    if (image_len < OTA_WRITER_HEADER_LEN || image_len > writer->partition->size) {
+        ESP_LOGE(TAG, "image size %d does not fit partition", image_len);
+        ota_writer_abort(writer, OTA_FAILURE_INVALID_IMAGE);
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    err = esp_ota_begin(writer->partition, image_len, &writer->handle);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "esp_ota_begin failed (%s)", esp_err_to_name(err));
+        ota_writer_abort(writer, OTA_FAILURE_FLASH_ERROR);
+        return err;
+    }
+
+    writer->header_checked = true;
+    writer->random_access = true;
+    writer->image_len = image_len;
+
+    ESP_LOGI(TAG, "esp_ota_begin succeeded, %d bytes erased", image_len);
+
+    return ESP_OK;
+}
+
+esp_err_t ota_writer_write_at(ota_writer_t *writer, size_t offset, const void *data, size_t len) {
+    esp_err_t err;
+
+    if (!writer->random_access || offset + len > writer->image_len) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    err = esp_ota_write_with_offset(writer->handle, data, len, offset);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "esp_ota_write_with_offset failed (%s)", esp_err_to_name(err));
+        ota_writer_abort(writer, OTA_FAILURE_FLASH_ERROR);
+        return err;
+    }
+
+    ota_writer_progress(writer, len);
+
+    return ESP_OK;
+}
+
+uint8_t ota_writer_check_progress(ota_writer_t *writer) {
+    int64_t now = esp_timer_get_time();
+    int64_t window_us = now - writer->window_start_us;
+    uint64_t window_bps;
+
+    if (now - writer->last_progress_us > OTA_STALL_TIMEOUT_MS * 1000LL) {
+        ESP_LOGE(TAG, "no data for %d ms, giving up", OTA_STALL_TIMEOUT_MS);
+        return OTA_FAILURE_STALL;
+    }
+
+    if (window_us >= OTA_THROUGHPUT_WINDOW_MS * 1000LL) {
+        window_bps = (uint64_t)(writer->written - writer->window_start_written) * 1000000 / window_us;
+
+        // the window is shorter than the stall timeout, so a client that went quiet is left to that check and a dead
+        // connection is reported as a stall, the window stays open until data arrives again
+        if (now - writer->last_progress_us > OTA_THROUGHPUT_IDLE_MS * 1000LL) {
+            return OTA_FAILURE_NONE;
+        }
+
+        if (window_bps < OTA_THROUGHPUT_MIN_BPS) {
+            ESP_LOGE(TAG, "client too slow (%" PRIu64 " B/s), giving up", window_bps);
+            return OTA_FAILURE_SLOW_CLIENT;
+        }
+
+        writer->window_start_us = now;
+        writer->window_start_written = writer->written;
+    }
+
+    return OTA_FAILURE_NONE;
+}
+
+// blocks may have arrived in any order, so hash what actually landed in flash
+static esp_err_t ota_writer_hash_partition(ota_writer_t *writer) {
+    esp_err_t err;
+    const void *map_ptr;
+    spi_flash_mmap_handle_t map_handle;
+
+    err = esp_partition_mmap(writer->partition, 0, writer->image_len, SPI_FLASH_MMAP_DATA, &map_ptr, &map_handle);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "unable to mmap OTA partition");
+        return err;
+    }
+
+    mbedtls_sha256_update(&writer->sha256_ctx, map_ptr, writer->image_len);
+
+    spi_flash_munmap(map_handle);
+
+    return ESP_OK;
+}
+
+// the whole image is in RAM, so check everything before the partition is touched, then program it in one go
+static esp_err_t ota_writer_commit_staging(ota_writer_t *writer, const uint8_t *sha256) {
+    esp_err_t err;
+    size_t offset;
+    uint8_t digest[OTA_WRITER_SHA256_LEN];
+
+    const esp_image_header_t *header = (const esp_image_header_t *)writer->staging;
+    const esp_app_desc_t *app_desc =
+        (const esp_app_desc_t *)(writer->staging + sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t));
+
+    if (writer->written != writer->image_len) {
+        ESP_LOGE(TAG, "image truncated, got %d of %d bytes", writer->written, writer->image_len);
+        ota_writer_abort(writer, OTA_FAILURE_SHORT_BODY);
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    if (header->magic != ESP_IMAGE_HEADER_MAGIC || header->chip_id != CONFIG_IDF_FIRMWARE_CHIP_ID ||
+        app_desc->magic_word != ESP_APP_DESC_MAGIC_WORD) {
+        ESP_LOGE(TAG, "not an app image for this chip");
+        ota_writer_abort(writer, OTA_FAILURE_INVALID_IMAGE);
+        return ESP_ERR_OTA_VALIDATE_FAILED;
+    }
+
+    ESP_LOGI(TAG, "new firmware version: %s", app_desc->version);
+
+    mbedtls_sha256_finish(&writer->sha256_ctx, digest);
+
+    if (sha256 != NULL && memcmp(digest, sha256, sizeof(digest)) != 0) {
+        ESP_LOGE(TAG, "image SHA-256 mismatch");
+        ota_writer_abort(writer, OTA_FAILURE_INVALID_IMAGE);
+        return ESP_ERR_INVALID_CRC;
+    }
+
+    if (header->hash_appended) {
+        mbedtls_sha256(writer->staging, writer->image_len - OTA_WRITER_SHA256_LEN, digest, 0);
+
+        if (memcmp(digest, writer->staging + writer->image_len - OTA_WRITER_SHA256_LEN, sizeof(digest)) != 0) {
+            ESP_LOGE(TAG, "appended SHA-256 mismatch, image is corrupted");
+            ota_writer_abort(writer, OTA_FAILURE_INVALID_IMAGE);
+            return ESP_ERR_INVALID_CRC;
+        }
+    }
+
+    err = esp_ota_begin(writer->partition, writer->image_len, &writer->handle);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "esp_ota_begin failed (%s)", esp_err_to_name(err));
+        ota_writer_abort(writer, OTA_FAILURE_FLASH_ERROR);
+        return err;
+    }
+
+    writer->header_checked = true;
+
+    for (offset = 0; offset < writer->image_len; offset += OTA_WRITER_STAGING_WRITE_SIZE) {
+        err = esp_ota_write(writer->handle, writer->staging + offset,
+                            MIN(writer->image_len - offset, OTA_WRITER_STAGING_WRITE_SIZE));
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "esp_ota_write failed (%s)", esp_err_to_name(err));
+            ota_writer_abort(writer, OTA_FAILURE_FLASH_ERROR);
+            return err;
+        }
+    }
+
+    ESP_LOGI(TAG, "staged image written to flash");
+
+    return ESP_OK;
+}
+
+esp_err_t ota_writer_end(ota_writer_t *writer, const uint8_t *sha256) {
+    esp_err_t err;
+    uint8_t digest[OTA_WRITER_SHA256_LEN];
+
+    ESP_LOGI(TAG, "total write binary data length: %d", writer->written);
+
+    if (writer->staging != NULL) {
+        err = ota_writer_commit_staging(writer, sha256);
+        if (err != ESP_OK) {
+            return err;
+        }
+
+    } else {
+        if (!writer->header_checked) {
+            ESP_LOGE(TAG, "no image data received");
+            ota_writer_abort(writer, OTA_FAILURE_SHORT_BODY);
+            return ESP_ERR_INVALID_SIZE;
+        }
+
+        if (writer->random_access) {
+            err = ota_writer_hash_partition(writer);
+            if (err != ESP_OK) {
+                ota_writer_abort(writer, OTA_FAILURE_FLASH_ERROR);
+                return err;
+            }
+        }
+
+        mbedtls_sha256_finish(&writer->sha256_ctx, digest);
+
+        if (sha256 != NULL && memcmp(digest, sha256, sizeof(digest)) != 0) {
+            ESP_LOGE(TAG, "image SHA-256 mismatch");
+            ota_writer_abort(writer, OTA_FAILURE_INVALID_IMAGE);
+            return ESP_ERR_INVALID_CRC;
+        }
+    }
+
+    err = esp_ota_end(writer->handle);
+    writer->header_checked = false;
+
+    if (err != ESP_OK) {
+        if (err == ESP_ERR_OTA_VALIDATE_FAILED) {
+            ESP_LOGE(TAG, "image validation failed, image is corrupted");
+        }
+        ESP_LOGE(TAG, "esp_ota_end failed (%s)!", esp_err_to_name(err));
+
+        ota_writer_abort(writer,
+                         err == ESP_ERR_OTA_VALIDATE_FAILED ? OTA_FAILURE_INVALID_IMAGE : OTA_FAILURE_FLASH_ERROR);
+        return err;
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t ota_writer_activate(ota_writer_t *writer) {
+    esp_err_t err;
+
+    err = esp_ota_set_boot_partition(writer->partition);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "esp_ota_set_boot_partition failed (%s)!", esp_err_to_name(err));
+        ota_writer_abort(writer, OTA_FAILURE_FLASH_ERROR);
+        return err;
+    }
+
+    metrics_ota_result(OTA_FAILURE_NONE, writer->written, esp_timer_get_time() - writer->begin_us);
+    ota_writer_release(writer);
+
+    return ESP_OK;
+}
+
+void ota_writer_abort(ota_writer_t *writer, uint8_t reason) {
+    if (!writer->claimed) {
+        return;
+    }
+
+    if (writer->header_checked) {
+        esp_ota_abort(writer->handle);
+        writer->header_checked = false;
+    }
+
+    writer->failure = reason;
+    metrics_ota_result(reason, writer->written, esp_timer_get_time() - writer->begin_us);
+
+    ota_writer_release(writer);
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+#include "esp_image_format.h"
+#include "esp_ota_ops.h"
+#include "mbedtls/sha256.h"
+#include "otaserver.h"
+
+#define OTA_WRITER_HEADER_LEN                                                                                         \
+    (sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t) + sizeof(esp_app_desc_t))
+
+#define OTA_WRITER_SHA256_LEN 32
+
+// flash is programmed in chunks of this size once a staged image has been verified
+#define OTA_WRITER_STAGING_WRITE_SIZE (64 * 1024)
+
+typedef struct {
+    const esp_partition_t *partition;
+    esp_ota_handle_t handle;
+    bool claimed;
+    bool header_checked;
+    bool random_access;
+    size_t image_len;
+    size_t written;
+    uint8_t failure;
+    int64_t begin_us;
+    int64_t last_progress_us;
+    int64_t window_start_us;
+    size_t window_start_written;
+    uint8_t *staging;
+    mbedtls_sha256_context sha256_ctx;
+} ota_writer_t;
+
+// true while a session holds the OTA partition, lets a receiver skip ota_writer_begin (which counts as a failure)
+bool ota_writer_is_busy(void);
+
+// claim the OTA partition, fails with ESP_ERR_INVALID_STATE while another session is writing
+esp_err_t ota_writer_begin(ota_writer_t *writer);
+
+// Every call below that fails has already aborted the session, writer->failure holds the OTA_FAILURE_* reason.
+
+// Receive the whole image into PSRAM and only erase and program the partition from ota_writer_end once size and
+// SHA-256 check out. Returns false, leaving the writer streaming to flash, when there is not enough PSRAM.
+bool ota_writer_stage(ota_writer_t *writer, size_t image_len);
+
+// the first chunk has to hold at least OTA_WRITER_HEADER_LEN bytes
+esp_err_t ota_writer_write(ota_writer_t *writer, const void *data, size_t len);
+
+// erase room for image_len bytes up front so the image can be written in any order with ota_writer_write_at
+esp_err_t ota_writer_prepare(ota_writer_t *writer, size_t image_len);
+
+esp_err_t ota_writer_write_at(ota_writer_t *writer, size_t offset, const void *data, size_t len);
+
+// returns OTA_FAILURE_STALL or OTA_FAILURE_SLOW_CLIENT once the session falls behind, to be polled while receiving
+uint8_t ota_writer_check_progress(ota_writer_t *writer);
+
+// finish the image and check it against sha256 (may be NULL), the boot partition is left untouched
+esp_err_t ota_writer_end(ota_writer_t *writer, const uint8_t *sha256);
+
+// make the finished image the boot partition and release the session
+esp_err_t ota_writer_activate(ota_writer_t *writer);
+
+void ota_writer_abort(ota_writer_t *writer, uint8_t reason);
+
+#ifdef __cplusplus
+}
+#endif
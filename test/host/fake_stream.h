@@ -0,0 +1,77 @@
+#pragma once
+
+// Scripted peer for the stream receivers: hands out fake_stream.data in reads of at most max_read bytes and, once
+// fault_at bytes went out, fails the way the fault says, for good or for fault_reads reads. Time moves on by
+// ms_per_read with every read.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "host_stubs.h"
+
+typedef enum {
+    FAKE_STREAM_OK,
+    FAKE_STREAM_STALL,  // nothing arrives, every read times out after timeout_ms
+    FAKE_STREAM_ERROR,  // the connection breaks
+    FAKE_STREAM_CLOSED, // the peer closes the connection
+} fake_stream_fault_t;
+
+typedef struct {
+    const uint8_t *data;
+    size_t len;
+    size_t pos;
+    size_t max_read;
+    size_t fault_at;
+    fake_stream_fault_t fault;
+    int fault_reads; // failing reads before the stream carries on, 0 fails for good
+    int64_t ms_per_read;
+    int64_t timeout_ms;
+} fake_stream_t;
+
+static fake_stream_t fake_stream;
+
+static inline void fake_stream_reset(const void *data, size_t len, int64_t timeout_ms) {
+    memset(&fake_stream, 0, sizeof(fake_stream));
+
+    fake_stream.data = data;
+    fake_stream.len = len;
+    fake_stream.max_read = SIZE_MAX;
+    fake_stream.fault_at = SIZE_MAX;
+    fake_stream.timeout_ms = timeout_ms;
+}
+
+// bytes read into buf, 0 for end of stream, -1 with the fault otherwise
+static inline long fake_stream_read(void *buf, size_t size, fake_stream_fault_t *fault) {
+    size_t len;
+
+    *fault = FAKE_STREAM_OK;
+
+    if (fake_stream.pos >= fake_stream.fault_at && fake_stream.fault != FAKE_STREAM_OK) {
+        *fault = fake_stream.fault;
+
+        if (fake_stream.fault_reads > 0 && --fake_stream.fault_reads == 0) {
+            fake_stream.fault = FAKE_STREAM_OK;
+        }
+
+        if (*fault == FAKE_STREAM_STALL) {
+            host_advance_time_ms(fake_stream.timeout_ms);
+        }
+
+        return *fault == FAKE_STREAM_CLOSED ? 0 : -1;
+    }
+
+    len = fake_stream.len - fake_stream.pos;
+    len = len < size ? len : size;
+    len = len < fake_stream.max_read ? len : fake_stream.max_read;
+    if (fake_stream.fault != FAKE_STREAM_OK && fake_stream.fault_at - fake_stream.pos < len) {
+        len = fake_stream.fault_at - fake_stream.pos;
+    }
+
+    memcpy(buf, fake_stream.data + fake_stream.pos, len);
+    fake_stream.pos += len;
+
+    host_advance_time_ms(fake_stream.ms_per_read);
+
+    return len;
+}
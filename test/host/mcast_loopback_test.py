@@ -0,0 +1,84 @@
+#!/usr/bin/env python3
+"""Update the host build of the multicast receiver with tools/ota_mcast_send.py over loopback.
+
+The receiver drops every 7th DATA packet and takes 1.5 s to erase, so the sender
+has to wait for it to get ready and repair the gaps from its NACKs. A second
+sender run during the restart delay must be answered with DONE without the
+receiver erasing the verified image again.
+"""
+
+import os
+import random
+import subprocess
+import sys
+import tempfile
+import time
+
+IMAGE_LEN = 300 * 1024 + 123
+
+
+def run_sender(sender, image_path, announce):
+    return subprocess.run(
+        [
+            sys.executable,
+            sender,
+            image_path,
+            "--iface",
+            "127.0.0.1",
+            "--nodes",
+            "1",
+            "--rate",
+            "4000",
+            "--announce",
+            str(announce),
+        ],
+        capture_output=True,
+        text=True,
+        timeout=60,
+    )
+
+
+def main():
+    receiver_bin, sender = sys.argv[1:3]
+
+    with tempfile.TemporaryDirectory() as tmp:
+        image_path = os.path.join(tmp, "image.bin")
+        with open(image_path, "wb") as f:
+            f.write(random.Random(1).randbytes(IMAGE_LEN))
+
+        receiver = subprocess.Popen(
+            [receiver_bin, image_path, "--drop", "7", "--erase-ms", "1500"],
+            stdout=subprocess.PIPE,
+            stderr=subprocess.STDOUT,
+            text=True,
+        )
+
+        try:
+            time.sleep(0.5)
+
+            first = run_sender(sender, image_path, 10)
+            print(first.stdout)
+            if first.returncode != 0:
+                print("FAIL: first sender run did not see the node finish")
+                return 1
+
+            again = run_sender(sender, image_path, 2)
+            print(again.stdout)
+            if again.returncode != 0 or "image verified" not in again.stdout:
+                print("FAIL: completed node did not answer END with DONE")
+                return 1
+
+            output, _ = receiver.communicate(timeout=15)
+        except subprocess.TimeoutExpired:
+            receiver.kill()
+            output, _ = receiver.communicate()
+            print(output)
+            print("FAIL: receiver did not restart")
+            return 1
+
+        print(output)
+        return receiver.returncode
+
+
+if __name__ == "__main__":
+    sys.exit(main())
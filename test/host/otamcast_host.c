@@ -0,0 +1,111 @@
+// The multicast receiver as a host process on loopback, for mcast_loopback_test.py and manual runs against
+// tools/ota_mcast_send.py --iface 127.0.0.1.
+//
+//   otamcast_host <image> [--drop N] [--erase-ms MS]
+//
+// --drop loses every Nth DATA packet on its way in, --erase-ms makes esp_ota_begin take as long as a real erase.
+// Exits 0 once the restart after a verified update finds <image> in ota_0, marked as boot partition and written by
+// a single session.
+
+#include "host_stubs.h"
+#include "lwip/sockets.h"
+
+ssize_t otamcast_host_recvfrom(int sock, void *buf, size_t len, int flags, struct sockaddr *from,
+                               socklen_t *from_len);
+
+#define recvfrom otamcast_host_recvfrom
+#include "otamcast.c"
+#undef recvfrom
+
+#define OTAMCAST_HOST_TIMEOUT_S 90
+
+static uint8_t *expected_image;
+static size_t expected_len;
+static unsigned long drop_every;
+static unsigned long data_packets;
+
+ssize_t otamcast_host_recvfrom(int sock, void *buf, size_t len, int flags, struct sockaddr *from,
+                               socklen_t *from_len) {
+    const ota_mcast_header_t *header = (const ota_mcast_header_t *)buf;
+    ssize_t ret;
+
+    while (true) {
+        ret = recvfrom(sock, buf, len, flags, from, from_len);
+
+        if (drop_every > 0 && ret >= (ssize_t)sizeof(*header) && header->type == OTA_MCAST_TYPE_DATA &&
+            ++data_packets % drop_every == 0) {
+            continue;
+        }
+
+        return ret;
+    }
+}
+
+static void otamcast_host_restart(void) {
+    const esp_partition_t *ota_0 =
+        esp_partition_find_first(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_OTA_0, NULL);
+
+    if (host_boot_partition != ota_0) {
+        printf("FAIL: ota_0 is not the boot partition\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (host_ota_begin_calls != 1) {
+        printf("FAIL: ota_0 was erased %d times\n", host_ota_begin_calls);
+        exit(EXIT_FAILURE);
+    }
+
+    if (memcmp(host_flash, expected_image, expected_len) != 0) {
+        printf("FAIL: ota_0 does not hold the image\n");
+        exit(EXIT_FAILURE);
+    }
+
+    printf("restart with verified image, %lu DATA packets dropped\n", drop_every ? data_packets / drop_every : 0);
+    exit(EXIT_SUCCESS);
+}
+
+int main(int argc, char **argv) {
+    FILE *f;
+    int i;
+
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <image> [--drop N] [--erase-ms MS]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    host_stubs_reset();
+    host_restart_hook = otamcast_host_restart;
+
+    for (i = 2; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "--drop") == 0) {
+            drop_every = strtoul(argv[i + 1], NULL, 10);
+        } else if (strcmp(argv[i], "--erase-ms") == 0) {
+            host_erase_delay_ms = atoi(argv[i + 1]);
+        }
+    }
+
+    f = fopen(argv[1], "rb");
+    if (f == NULL || fseek(f, 0, SEEK_END) != 0) {
+        perror(argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    expected_len = ftell(f);
+    expected_image = malloc(expected_len);
+    rewind(f);
+    if (expected_image == NULL || fread(expected_image, 1, expected_len, f) != expected_len) {
+        perror(argv[1]);
+        return EXIT_FAILURE;
+    }
+    fclose(f);
+
+    if (otamcast_start(NULL) != ESP_OK) {
+        return EXIT_FAILURE;
+    }
+
+    // the receiver task runs on its own thread, the restart hook ends the process
+    sleep(OTAMCAST_HOST_TIMEOUT_S);
+
+    printf("FAIL: no verified image after %d s\n", OTAMCAST_HOST_TIMEOUT_S);
+    return EXIT_FAILURE;
+}
@@ -0,0 +1,10 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define MALLOC_CAP_SPIRAM (1 << 10)
+
+// allocations succeed while they fit into host_psram_free, see host_stubs.h
+void *heap_caps_malloc(size_t size, uint32_t caps);
+void heap_caps_free(void *ptr);
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdio.h>
+
+typedef int (*vprintf_like_t)(const char *, va_list);
+
+vprintf_like_t esp_log_set_vprintf(vprintf_like_t func);
+
+#define ESP_LOGE(tag, format, ...) printf("E %s: " format "\n", tag, ##__VA_ARGS__)
+#define ESP_LOGW(tag, format, ...) printf("W %s: " format "\n", tag, ##__VA_ARGS__)
+#define ESP_LOGI(tag, format, ...) printf("I %s: " format "\n", tag, ##__VA_ARGS__)
+#define ESP_LOGD(tag, format, ...) ((void)(tag))
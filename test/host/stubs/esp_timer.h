@@ -0,0 +1,6 @@
+#pragma once
+
+#include <stdint.h>
+
+// monotonic time plus host_time_offset_us, see host_stubs.h
+int64_t esp_timer_get_time(void);
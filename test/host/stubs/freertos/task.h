@@ -0,0 +1,12 @@
+#pragma once
+
+#include "freertos/FreeRTOS.h"
+
+typedef void (*TaskFunction_t)(void *);
+typedef void *TaskHandle_t;
+
+// tasks run as detached threads, vTaskDelete(NULL) ends the calling one
+BaseType_t xTaskCreate(TaskFunction_t task, const char *name, uint32_t stack_depth, void *parameters,
+                       unsigned int priority, TaskHandle_t *created_task);
+void vTaskDelay(TickType_t ticks);
+void vTaskDelete(TaskHandle_t task);
@@ -0,0 +1,366 @@
+#include "host_stubs.h"
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "esp_heap_caps.h"
+#include "esp_image_format.h"
+#include "esp_log.h"
+#include "esp_ota_ops.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "freertos/task.h"
+#include "otaserver.h"
+
+#define HOST_OTA_HANDLE 1
+
+static const esp_partition_t host_factory = {
+    .type = ESP_PARTITION_TYPE_APP,
+    .subtype = ESP_PARTITION_SUBTYPE_APP_FACTORY,
+    .address = 0x10000,
+    .size = 0x100000,
+    .erase_size = SPI_FLASH_SEC_SIZE,
+    .label = "factory",
+};
+
+static const esp_partition_t host_ota_0 = {
+    .type = ESP_PARTITION_TYPE_APP,
+    .subtype = ESP_PARTITION_SUBTYPE_APP_OTA_0,
+    .address = 0x110000,
+    .size = HOST_PARTITION_SIZE,
+    .erase_size = SPI_FLASH_SEC_SIZE,
+    .label = "ota_0",
+};
+
+uint8_t host_flash[HOST_PARTITION_SIZE];
+
+const esp_partition_t *host_boot_partition;
+int host_ota_begin_calls;
+int host_ota_abort_calls;
+int host_ota_write_fail_at;
+esp_err_t host_ota_end_result;
+int host_erase_delay_ms;
+size_t host_psram_size;
+size_t host_image_len;
+bool host_tasks_enabled = true;
+char host_last_task[32];
+int host_restart_calls;
+void (*host_restart_hook)(void);
+
+static _Atomic int64_t host_time_offset_us;
+
+static bool host_ota_open;
+static size_t host_ota_erased;
+static size_t host_ota_offset;
+static int host_ota_write_calls;
+
+void host_stubs_reset(void) {
+    memset(host_flash, 0xff, sizeof(host_flash));
+
+    host_boot_partition = NULL;
+    host_ota_begin_calls = 0;
+    host_ota_abort_calls = 0;
+    host_ota_write_fail_at = 0;
+    host_ota_end_result = ESP_OK;
+    host_erase_delay_ms = 0;
+    host_psram_size = 0;
+    host_image_len = 0;
+    host_tasks_enabled = true;
+    host_last_task[0] = '\0';
+    host_restart_calls = 0;
+    host_restart_hook = NULL;
+
+    host_ota_open = false;
+    host_ota_erased = 0;
+    host_ota_offset = 0;
+    host_ota_write_calls = 0;
+}
+
+void host_advance_time_ms(int64_t ms) { atomic_fetch_add(&host_time_offset_us, ms * 1000); }
+
+int64_t esp_timer_get_time(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000 + atomic_load(&host_time_offset_us);
+}
+
+const char *esp_err_to_name(esp_err_t code) {
+    switch (code) {
+        case ESP_OK:
+            return "ESP_OK";
+        case ESP_FAIL:
+            return "ESP_FAIL";
+        case ESP_ERR_NO_MEM:
+            return "ESP_ERR_NO_MEM";
+        case ESP_ERR_INVALID_ARG:
+            return "ESP_ERR_INVALID_ARG";
+        case ESP_ERR_INVALID_STATE:
+            return "ESP_ERR_INVALID_STATE";
+        case ESP_ERR_INVALID_SIZE:
+            return "ESP_ERR_INVALID_SIZE";
+        case ESP_ERR_FLASH_OP_FAIL:
+            return "ESP_ERR_FLASH_OP_FAIL";
+        case ESP_ERR_OTA_VALIDATE_FAILED:
+            return "ESP_ERR_OTA_VALIDATE_FAILED";
+        default:
+            return "ERROR";
+    }
+}
+
+vprintf_like_t host_log_vprintf = vprintf;
+
+vprintf_like_t esp_log_set_vprintf(vprintf_like_t func) {
+    vprintf_like_t prev = host_log_vprintf;
+
+    host_log_vprintf = func;
+    return prev;
+}
+
+void *heap_caps_malloc(size_t size, uint32_t caps) {
+    if ((caps & MALLOC_CAP_SPIRAM) && size > host_psram_size) {
+        return NULL;
+    }
+
+    return malloc(size);
+}
+
+void heap_caps_free(void *ptr) { free(ptr); }
+
+const esp_partition_t *esp_partition_find_first(esp_partition_type_t type, esp_partition_subtype_t subtype,
+                                                const char *label) {
+    (void)label;
+
+    if (type == ESP_PARTITION_TYPE_APP && subtype == ESP_PARTITION_SUBTYPE_APP_OTA_0) {
+        return &host_ota_0;
+    }
+
+    if (type == ESP_PARTITION_TYPE_APP && subtype == ESP_PARTITION_SUBTYPE_APP_FACTORY) {
+        return &host_factory;
+    }
+
+    return NULL;
+}
+
+esp_err_t esp_partition_mmap(const esp_partition_t *partition, size_t offset, size_t size,
+                             spi_flash_mmap_memory_t memory, const void **out_ptr,
+                             spi_flash_mmap_handle_t *out_handle) {
+    (void)memory;
+
+    if (partition != &host_ota_0 || offset + size > HOST_PARTITION_SIZE) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    *out_ptr = host_flash + offset;
+    *out_handle = 1;
+
+    return ESP_OK;
+}
+
+void spi_flash_munmap(spi_flash_mmap_handle_t handle) { (void)handle; }
+
+esp_err_t esp_partition_get_sha256(const esp_partition_t *partition, uint8_t *sha_256) {
+    (void)partition;
+    memset(sha_256, 0, 32);
+    return ESP_OK;
+}
+
+esp_err_t esp_image_get_metadata(const esp_partition_pos_t *part, esp_image_metadata_t *metadata) {
+    (void)part;
+
+    if (host_image_len == 0) {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    metadata->image_len = host_image_len;
+    return ESP_OK;
+}
+
+const esp_partition_t *esp_ota_get_running_partition(void) { return &host_factory; }
+
+esp_err_t esp_ota_get_state_partition(const esp_partition_t *partition, esp_ota_img_states_t *ota_state) {
+    (void)partition;
+    (void)ota_state;
+    return ESP_ERR_NOT_FOUND;
+}
+
+esp_err_t esp_ota_mark_app_valid_cancel_rollback(void) { return ESP_OK; }
+
+esp_err_t esp_ota_get_partition_description(const esp_partition_t *partition, esp_app_desc_t *app_desc) {
+    (void)partition;
+    (void)app_desc;
+    return ESP_ERR_NOT_FOUND;
+}
+
+static void host_erase(size_t len) {
+    len = (len + SPI_FLASH_SEC_SIZE - 1) / SPI_FLASH_SEC_SIZE * SPI_FLASH_SEC_SIZE;
+    if (len > HOST_PARTITION_SIZE) {
+        len = HOST_PARTITION_SIZE;
+    }
+
+    if (len > host_ota_erased) {
+        memset(host_flash + host_ota_erased, 0xff, len - host_ota_erased);
+        host_ota_erased = len;
+    }
+}
+
+esp_err_t esp_ota_begin(const esp_partition_t *partition, size_t image_size, esp_ota_handle_t *out_handle) {
+    if (partition != &host_ota_0 || host_ota_open) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    host_ota_begin_calls++;
+    host_ota_open = true;
+    host_ota_erased = 0;
+    host_ota_offset = 0;
+
+    if (image_size != OTA_WITH_SEQUENTIAL_WRITES) {
+        host_erase(image_size == OTA_SIZE_UNKNOWN ? HOST_PARTITION_SIZE : image_size);
+
+        if (host_erase_delay_ms > 0) {
+            usleep(host_erase_delay_ms * 1000);
+        }
+    }
+
+    *out_handle = HOST_OTA_HANDLE;
+
+    return ESP_OK;
+}
+
+static esp_err_t host_ota_write(esp_ota_handle_t handle, const void *data, size_t size, size_t offset) {
+    if (handle != HOST_OTA_HANDLE || !host_ota_open || offset + size > HOST_PARTITION_SIZE) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (++host_ota_write_calls == host_ota_write_fail_at) {
+        return ESP_ERR_FLASH_OP_FAIL;
+    }
+
+    memcpy(host_flash + offset, data, size);
+
+    return ESP_OK;
+}
+
+esp_err_t esp_ota_write(esp_ota_handle_t handle, const void *data, size_t size) {
+    esp_err_t err;
+
+    // sequential sessions erase as they go
+    host_erase(host_ota_offset + size);
+
+    err = host_ota_write(handle, data, size, host_ota_offset);
+    if (err == ESP_OK) {
+        host_ota_offset += size;
+    }
+
+    return err;
+}
+
+esp_err_t esp_ota_write_with_offset(esp_ota_handle_t handle, const void *data, size_t size, uint32_t offset) {
+    // the real one asserts that the range was erased by esp_ota_begin
+    if (offset + size > host_ota_erased) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    return host_ota_write(handle, data, size, offset);
+}
+
+esp_err_t esp_ota_end(esp_ota_handle_t handle) {
+    if (handle != HOST_OTA_HANDLE || !host_ota_open) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    host_ota_open = false;
+
+    return host_ota_end_result;
+}
+
+esp_err_t esp_ota_abort(esp_ota_handle_t handle) {
+    if (handle != HOST_OTA_HANDLE || !host_ota_open) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    host_ota_abort_calls++;
+    host_ota_open = false;
+
+    return ESP_OK;
+}
+
+esp_err_t esp_ota_set_boot_partition(const esp_partition_t *partition) {
+    host_boot_partition = partition;
+    return ESP_OK;
+}
+
+typedef struct {
+    TaskFunction_t task;
+    void *parameters;
+} host_task_t;
+
+static void *host_task_entry(void *arg) {
+    host_task_t task = *(host_task_t *)arg;
+
+    free(arg);
+    task.task(task.parameters);
+
+    return NULL;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t task, const char *name, uint32_t stack_depth, void *parameters,
+                       unsigned int priority, TaskHandle_t *created_task) {
+    pthread_t thread;
+    host_task_t *host_task;
+
+    (void)stack_depth;
+    (void)priority;
+
+    snprintf(host_last_task, sizeof(host_last_task), "%s", name);
+    if (created_task != NULL) {
+        *created_task = NULL;
+    }
+
+    if (!host_tasks_enabled) {
+        return pdPASS;
+    }
+
+    host_task = malloc(sizeof(*host_task));
+    host_task->task = task;
+    host_task->parameters = parameters;
+
+    if (pthread_create(&thread, NULL, host_task_entry, host_task) != 0) {
+        free(host_task);
+        return pdFAIL;
+    }
+
+    pthread_detach(thread);
+
+    return pdPASS;
+}
+
+void vTaskDelay(TickType_t ticks) { usleep((useconds_t)ticks * 1000); }
+
+void vTaskDelete(TaskHandle_t task) {
+    if (task == NULL) {
+        pthread_exit(NULL);
+    }
+}
+
+void esp_restart(void) {
+    host_restart_calls++;
+
+    if (host_restart_hook != NULL) {
+        host_restart_hook();
+    }
+}
+
+// otaserver.c has the real one, the other receivers only schedule it
+__attribute__((weak)) void esp_restart_task(void *pvParameter) {
+    (void)pvParameter;
+
+    vTaskDelay(OTA_RESTART_DELAY_TICKS);
+    esp_restart();
+
+    vTaskDelete(NULL);
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+// Knobs and observations of the host stubs, host_stubs_reset() restores the defaults between tests.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+#include "esp_log.h"
+#include "esp_partition.h"
+
+#define HOST_PARTITION_SIZE (512 * 1024)
+
+// contents of ota_0, erased to 0xff by esp_ota_begin like real flash
+extern uint8_t host_flash[HOST_PARTITION_SIZE];
+
+extern const esp_partition_t *host_boot_partition;
+extern int host_ota_begin_calls;
+extern int host_ota_abort_calls;
+
+// 1-based index of the esp_ota_write/esp_ota_write_with_offset call that fails, 0 for none
+extern int host_ota_write_fail_at;
+extern esp_err_t host_ota_end_result;
+extern int host_erase_delay_ms;
+
+// largest block heap_caps_malloc(MALLOC_CAP_SPIRAM) hands out, 0 means the chip has no PSRAM
+extern size_t host_psram_size;
+
+// length esp_image_get_metadata() reports for the image in ota_0, 0 when it finds none
+extern size_t host_image_len;
+
+// false records tasks in host_last_task without running them
+extern bool host_tasks_enabled;
+extern char host_last_task[32];
+
+extern int host_restart_calls;
+extern void (*host_restart_hook)(void);
+
+// what esp_log_set_vprintf() installed, ESP_LOGx still go straight to stdout
+extern vprintf_like_t host_log_vprintf;
+
+void host_stubs_reset(void);
+
+// move esp_timer_get_time forward without sleeping
+void host_advance_time_ms(int64_t ms);
@@ -0,0 +1,9 @@
+#pragma once
+
+// lwIP follows the BSD socket API, the host stack stands in for it
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
@@ -0,0 +1,103 @@
+#pragma once
+
+// Minimal checks for the host tests, a test binary exits non-zero once any CHECK failed.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "esp_image_format.h"
+#include "host_stubs.h"
+#include "mbedtls/sha256.h"
+#include "metrics.h"
+
+static int test_failures;
+
+#define CHECK(cond)                                                                                                   \
+    do {                                                                                                              \
+        if (!(cond)) {                                                                                                \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond);                                  \
+            test_failures++;                                                                                          \
+        }                                                                                                             \
+    } while (0)
+
+#define CHECK_INT(actual, expected)                                                                                   \
+    do {                                                                                                              \
+        long long actual_ = (long long)(actual);                                                                      \
+        long long expected_ = (long long)(expected);                                                                  \
+        if (actual_ != expected_) {                                                                                   \
+            fprintf(stderr, "%s:%d: %s is %lld, expected %lld\n", __FILE__, __LINE__, #actual, actual_, expected_);  \
+            test_failures++;                                                                                          \
+        }                                                                                                             \
+    } while (0)
+
+#define CHECK_STR(actual, expected)                                                                                   \
+    do {                                                                                                              \
+        const char *actual_ = (actual);                                                                               \
+        const char *expected_ = (expected);                                                                           \
+        if (actual_ == NULL || strcmp(actual_, expected_) != 0) {                                                     \
+            fprintf(stderr, "%s:%d: %s is \"%s\", expected \"%s\"\n", __FILE__, __LINE__, #actual,                    \
+                    actual_ != NULL ? actual_ : "(null)", expected_);                                                 \
+            test_failures++;                                                                                          \
+        }                                                                                                             \
+    } while (0)
+
+#define RUN_TEST(test)                                                                                                \
+    do {                                                                                                              \
+        printf("-- %s\n", #test);                                                                                     \
+        host_stubs_reset();                                                                                           \
+        test();                                                                                                       \
+    } while (0)
+
+static inline int test_result(void) {
+    if (test_failures != 0) {
+        fprintf(stderr, "%d check(s) failed\n", test_failures);
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+// value of a sample in the /metrics output, e.g. test_metric("ota_failures_total{reason=\"busy\"}")
+static inline long test_metric(const char *name) {
+    char buf[METRICS_BUFFSIZE];
+    const char *line;
+    size_t name_len = strlen(name);
+
+    metrics_format(buf, sizeof(buf));
+
+    for (line = buf; line != NULL; line = strchr(line, '\n')) {
+        if (*line == '\n') {
+            line++;
+        }
+
+        if (strncmp(line, name, name_len) == 0 && line[name_len] == ' ') {
+            return strtol(line + name_len + 1, NULL, 10);
+        }
+    }
+
+    return -1;
+}
+
+// app image for this chip: header, first segment header and app description followed by filler and, like the
+// images esptool builds, the SHA-256 of everything before it
+static inline void test_make_image(uint8_t *image, size_t len) {
+    esp_image_header_t *header = (esp_image_header_t *)image;
+    esp_app_desc_t *app_desc =
+        (esp_app_desc_t *)(image + sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t));
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        image[i] = (i * 31 + i / 977) & 0xff;
+    }
+
+    memset(image, 0, sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t) + sizeof(esp_app_desc_t));
+    header->magic = ESP_IMAGE_HEADER_MAGIC;
+    header->segment_count = 1;
+    header->chip_id = CONFIG_IDF_FIRMWARE_CHIP_ID;
+    header->hash_appended = 1;
+    app_desc->magic_word = ESP_APP_DESC_MAGIC_WORD;
+    strcpy(app_desc->version, "host-test");
+
+    mbedtls_sha256(image, len - 32, image + len - 32, 0);
+}
@@ -0,0 +1,370 @@
+// Multicast receiver state machine driven packet by packet: session start, NACK ranges, completion, and what
+// happens to packets arriving while another upload runs or after the image was verified.
+
+#include "otamcast.c"
+#include "test.h"
+
+#define TEST_IMAGE_LEN (100 * 1024 + 300)
+#define TEST_BLOCK_SIZE 1024
+#define TEST_BLOCK_COUNT ((TEST_IMAGE_LEN + TEST_BLOCK_SIZE - 1) / TEST_BLOCK_SIZE)
+
+static uint8_t test_image[TEST_IMAGE_LEN];
+static uint8_t test_sha256[OTA_WRITER_SHA256_LEN];
+
+// the receiver replies from receiver_sock, the test plays the sender on sender_sock
+static int receiver_sock;
+static int sender_sock;
+static struct sockaddr_in sender_addr;
+
+static uint8_t reply[sizeof(ota_mcast_header_t) + OTA_MCAST_NACK_MAX_RANGES * sizeof(ota_mcast_range_t)];
+static const uint8_t *reply_sha256 = test_sha256;
+
+static void feed(uint8_t type, uint32_t block, const uint8_t *sha256) {
+    ota_mcast_header_t *header = (ota_mcast_header_t *)otamcast_packet;
+    size_t len = 0;
+
+    header->magic = OTA_MCAST_MAGIC;
+    header->type = type;
+    header->reserved = 0;
+    header->block_size = TEST_BLOCK_SIZE;
+    header->image_len = TEST_IMAGE_LEN;
+    header->block = block;
+    memcpy(header->sha256, sha256, OTA_WRITER_SHA256_LEN);
+
+    if (type == OTA_MCAST_TYPE_DATA) {
+        len = MIN(TEST_BLOCK_SIZE, TEST_IMAGE_LEN - block * TEST_BLOCK_SIZE);
+        memcpy(otamcast_packet + sizeof(*header), test_image + block * TEST_BLOCK_SIZE, len);
+    }
+
+    otamcast_receive(receiver_sock, &otamcast_session, sizeof(*header) + len, &sender_addr);
+}
+
+// a receive timeout, lets the receiver send NACKs or give up on the sender
+static void feed_timeout(void) { otamcast_receive(receiver_sock, &otamcast_session, -1, &sender_addr); }
+
+// next reply of the receiver, 0 when there is none
+static uint8_t next_reply(size_t *range_count) {
+    const ota_mcast_header_t *header = (const ota_mcast_header_t *)reply;
+    ssize_t len = recv(sender_sock, reply, sizeof(reply), MSG_DONTWAIT);
+
+    if (len < (ssize_t)sizeof(*header)) {
+        return 0;
+    }
+
+    CHECK_INT(header->magic, OTA_MCAST_MAGIC);
+    CHECK(memcmp(header->sha256, reply_sha256, OTA_WRITER_SHA256_LEN) == 0);
+
+    if (range_count != NULL) {
+        *range_count = (len - sizeof(*header)) / sizeof(ota_mcast_range_t);
+    }
+
+    return header->type;
+}
+
+static const ota_mcast_range_t *reply_range(size_t i) {
+    return (const ota_mcast_range_t *)(reply + sizeof(ota_mcast_header_t)) + i;
+}
+
+static void session_reset(void) {
+    free(otamcast_session.bitmap);
+    memset(&otamcast_session, 0, sizeof(otamcast_session));
+
+    while (next_reply(NULL) != 0) {
+    }
+}
+
+static void test_announce_erases_and_requests_everything(void) {
+    size_t ranges;
+
+    session_reset();
+    feed(OTA_MCAST_TYPE_END, 0, test_sha256);
+
+    CHECK(otamcast_session.active);
+    CHECK_INT(host_ota_begin_calls, 1);
+    CHECK_INT(next_reply(&ranges), OTA_MCAST_TYPE_NACK);
+    CHECK_INT(ranges, 1);
+    CHECK_INT(reply_range(0)->first, 0);
+    CHECK_INT(reply_range(0)->count, TEST_BLOCK_COUNT);
+
+    otamcast_session_stop(&otamcast_session, OTA_FAILURE_RECV_ERROR);
+}
+
+static void test_nack_lists_missing_ranges(void) {
+    uint32_t block;
+    size_t ranges;
+
+    session_reset();
+    feed(OTA_MCAST_TYPE_END, 0, test_sha256);
+    next_reply(NULL);
+
+    for (block = 0; block < 10; block++) {
+        feed(OTA_MCAST_TYPE_DATA, block, test_sha256);
+    }
+    for (block = 20; block < 30; block++) {
+        feed(OTA_MCAST_TYPE_DATA, block, test_sha256);
+    }
+
+    // a duplicate must not count twice
+    feed(OTA_MCAST_TYPE_DATA, 5, test_sha256);
+
+    CHECK_INT(next_reply(NULL), 0);
+
+    host_advance_time_ms(OTA_MCAST_NACK_INTERVAL_MS + 1);
+    feed_timeout();
+
+    CHECK_INT(next_reply(&ranges), OTA_MCAST_TYPE_NACK);
+    CHECK_INT(((const ota_mcast_header_t *)reply)->block, 20);
+    CHECK_INT(ranges, 2);
+    CHECK_INT(reply_range(0)->first, 10);
+    CHECK_INT(reply_range(0)->count, 10);
+    CHECK_INT(reply_range(1)->first, 30);
+    CHECK_INT(reply_range(1)->count, TEST_BLOCK_COUNT - 30);
+
+    otamcast_session_stop(&otamcast_session, OTA_FAILURE_RECV_ERROR);
+}
+
+static void test_nack_range_limit(void) {
+    uint32_t block;
+    size_t ranges;
+
+    session_reset();
+    feed(OTA_MCAST_TYPE_END, 0, test_sha256);
+    next_reply(NULL);
+
+    for (block = 0; block < TEST_BLOCK_COUNT; block += 2) {
+        feed(OTA_MCAST_TYPE_DATA, block, test_sha256);
+    }
+
+    host_advance_time_ms(OTA_MCAST_NACK_INTERVAL_MS + 1);
+    feed_timeout();
+
+    CHECK_INT(next_reply(&ranges), OTA_MCAST_TYPE_NACK);
+    CHECK_INT(ranges, OTA_MCAST_NACK_MAX_RANGES);
+    CHECK_INT(reply_range(0)->first, 1);
+    CHECK_INT(reply_range(0)->count, 1);
+    CHECK_INT(reply_range(OTA_MCAST_NACK_MAX_RANGES - 1)->first, OTA_MCAST_NACK_MAX_RANGES * 2 - 1);
+
+    otamcast_session_stop(&otamcast_session, OTA_FAILURE_RECV_ERROR);
+}
+
+static void test_blocks_in_any_order_complete_the_image(void) {
+    int32_t block;
+    long successes = test_metric("ota_success_total");
+
+    session_reset();
+    host_tasks_enabled = false;
+
+    for (block = TEST_BLOCK_COUNT - 1; block >= 0; block--) {
+        feed(OTA_MCAST_TYPE_DATA, block, test_sha256);
+    }
+
+    CHECK(!otamcast_session.active);
+    CHECK(otamcast_session.completed);
+    CHECK_INT(next_reply(NULL), OTA_MCAST_TYPE_DONE);
+    CHECK(host_boot_partition == esp_partition_find_first(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_OTA_0,
+                                                          NULL));
+    CHECK(memcmp(host_flash, test_image, TEST_IMAGE_LEN) == 0);
+    CHECK_STR(host_last_task, "esp_restart_task");
+    CHECK_INT(test_metric("ota_success_total"), successes + 1);
+}
+
+static void test_completed_image_is_kept_until_restart(void) {
+    uint8_t other_sha256[OTA_WRITER_SHA256_LEN] = {1};
+    uint32_t block;
+
+    session_reset();
+    host_tasks_enabled = false;
+
+    for (block = 0; block < TEST_BLOCK_COUNT; block++) {
+        feed(OTA_MCAST_TYPE_DATA, block, test_sha256);
+    }
+    CHECK_INT(next_reply(NULL), OTA_MCAST_TYPE_DONE);
+
+    // the sender keeps going for the other nodes, none of it may start a session that erases ota_0 again
+    feed(OTA_MCAST_TYPE_DATA, 3, test_sha256);
+    feed(OTA_MCAST_TYPE_DATA, 3, other_sha256);
+    feed(OTA_MCAST_TYPE_END, 0, other_sha256);
+    CHECK_INT(next_reply(NULL), 0);
+
+    // a repeated END is answered with DONE in case the first one got lost
+    feed(OTA_MCAST_TYPE_END, 0, test_sha256);
+    CHECK_INT(next_reply(NULL), OTA_MCAST_TYPE_DONE);
+
+    host_advance_time_ms(OTA_MCAST_SESSION_TIMEOUT_MS + 1);
+    feed_timeout();
+
+    CHECK(!otamcast_session.active);
+    CHECK_INT(host_ota_begin_calls, 1);
+    CHECK(memcmp(host_flash, test_image, TEST_IMAGE_LEN) == 0);
+}
+
+static void test_sha256_mismatch_is_rejected(void) {
+    uint8_t wrong_sha256[OTA_WRITER_SHA256_LEN];
+    uint32_t block;
+    long invalid = test_metric("ota_failures_total{reason=\"invalid_image\"}");
+
+    memcpy(wrong_sha256, test_sha256, sizeof(wrong_sha256));
+    wrong_sha256[0] ^= 0xff;
+
+    session_reset();
+
+    for (block = 0; block < TEST_BLOCK_COUNT; block++) {
+        feed(OTA_MCAST_TYPE_DATA, block, wrong_sha256);
+    }
+
+    CHECK(!otamcast_session.active);
+    CHECK(!otamcast_session.completed);
+    CHECK(host_boot_partition == NULL);
+    CHECK_INT(host_ota_abort_calls, 1);
+    CHECK_INT(test_metric("ota_failures_total{reason=\"invalid_image\"}"), invalid + 1);
+
+    // the sender repeats the image for the other nodes, it must neither erase ota_0 again nor count another failure
+    reply_sha256 = wrong_sha256;
+    feed(OTA_MCAST_TYPE_END, 0, wrong_sha256);
+    CHECK_INT(next_reply(NULL), OTA_MCAST_TYPE_FAILED);
+    CHECK_INT(reply[sizeof(ota_mcast_header_t)], OTA_FAILURE_INVALID_IMAGE);
+
+    for (block = 0; block < TEST_BLOCK_COUNT; block++) {
+        feed(OTA_MCAST_TYPE_DATA, block, wrong_sha256);
+    }
+    feed(OTA_MCAST_TYPE_END, 0, wrong_sha256);
+    CHECK_INT(next_reply(NULL), OTA_MCAST_TYPE_FAILED);
+    reply_sha256 = test_sha256;
+
+    CHECK(!otamcast_session.active);
+    CHECK_INT(host_ota_begin_calls, 1);
+    CHECK_INT(test_metric("ota_failures_total{reason=\"invalid_image\"}"), invalid + 1);
+
+    // another image is taken again
+    feed(OTA_MCAST_TYPE_END, 0, test_sha256);
+    CHECK(otamcast_session.active);
+    CHECK_INT(host_ota_begin_calls, 2);
+    CHECK_INT(next_reply(NULL), OTA_MCAST_TYPE_NACK);
+
+    otamcast_session_stop(&otamcast_session, OTA_FAILURE_RECV_ERROR);
+}
+
+static void test_oversized_image_is_rejected_once(void) {
+    ota_mcast_header_t *header = (ota_mcast_header_t *)otamcast_packet;
+    long sessions = test_metric("ota_sessions_total");
+    int i;
+
+    session_reset();
+
+    for (i = 0; i < 100; i++) {
+        memset(header, 0, sizeof(*header));
+        header->magic = OTA_MCAST_MAGIC;
+        header->type = i % 10 == 9 ? OTA_MCAST_TYPE_END : OTA_MCAST_TYPE_DATA;
+        header->block_size = TEST_BLOCK_SIZE;
+        header->image_len = HOST_PARTITION_SIZE + 1;
+        header->block = i;
+        memcpy(header->sha256, test_sha256, sizeof(header->sha256));
+
+        otamcast_receive(receiver_sock, &otamcast_session, sizeof(*header), &sender_addr);
+    }
+
+    CHECK(!otamcast_session.active);
+    CHECK_INT(otamcast_session.rejected, OTA_FAILURE_INVALID_IMAGE);
+    CHECK_INT(host_ota_begin_calls, 0);
+    CHECK_INT(test_metric("ota_sessions_total"), sessions + 1);
+    CHECK_INT(next_reply(NULL), OTA_MCAST_TYPE_FAILED);
+    CHECK(!ota_writer_is_busy());
+}
+
+static void test_busy_writer_is_not_a_failure(void) {
+    ota_writer_t upload;
+    long busy = test_metric("ota_failures_total{reason=\"busy\"}");
+    long sessions;
+    int i;
+
+    session_reset();
+
+    CHECK_INT(ota_writer_begin(&upload), ESP_OK);
+    sessions = test_metric("ota_sessions_total");
+
+    for (i = 0; i < 100; i++) {
+        feed(OTA_MCAST_TYPE_DATA, i, test_sha256);
+    }
+
+    CHECK(!otamcast_session.active);
+    CHECK_INT(host_ota_begin_calls, 0);
+    CHECK_INT(next_reply(NULL), 0);
+    CHECK_INT(test_metric("ota_failures_total{reason=\"busy\"}"), busy);
+    CHECK_INT(test_metric("ota_sessions_total"), sessions);
+
+    ota_writer_abort(&upload, OTA_FAILURE_SHORT_BODY);
+
+    feed(OTA_MCAST_TYPE_END, 0, test_sha256);
+    CHECK(otamcast_session.active);
+
+    otamcast_session_stop(&otamcast_session, OTA_FAILURE_RECV_ERROR);
+}
+
+static void test_silent_sender_times_out(void) {
+    long stalls = test_metric("ota_failures_total{reason=\"stall\"}");
+
+    session_reset();
+    feed(OTA_MCAST_TYPE_DATA, 0, test_sha256);
+    CHECK(otamcast_session.active);
+
+    host_advance_time_ms(OTA_MCAST_SESSION_TIMEOUT_MS + 1);
+    feed_timeout();
+
+    CHECK(!otamcast_session.active);
+    CHECK_INT(host_ota_abort_calls, 1);
+    CHECK_INT(test_metric("ota_failures_total{reason=\"stall\"}"), stalls + 1);
+    CHECK(!ota_writer_is_busy());
+}
+
+static void test_flash_error_aborts(void) {
+    long flash_errors = test_metric("ota_failures_total{reason=\"flash_error\"}");
+
+    session_reset();
+    host_ota_write_fail_at = 2;
+
+    feed(OTA_MCAST_TYPE_DATA, 0, test_sha256);
+    CHECK(otamcast_session.active);
+    feed(OTA_MCAST_TYPE_DATA, 1, test_sha256);
+
+    CHECK(!otamcast_session.active);
+    CHECK_INT(test_metric("ota_failures_total{reason=\"flash_error\"}"), flash_errors + 1);
+    CHECK(!ota_writer_is_busy());
+
+    feed(OTA_MCAST_TYPE_END, 0, test_sha256);
+    CHECK_INT(next_reply(NULL), OTA_MCAST_TYPE_FAILED);
+    CHECK_INT(reply[sizeof(ota_mcast_header_t)], OTA_FAILURE_FLASH_ERROR);
+    CHECK_INT(host_ota_begin_calls, 1);
+}
+
+int main(void) {
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    socklen_t addr_len = sizeof(sender_addr);
+    size_t i;
+
+    for (i = 0; i < sizeof(test_image); i++) {
+        test_image[i] = (i * 7 + i / 251) & 0xff;
+    }
+    mbedtls_sha256(test_image, sizeof(test_image), test_sha256, 0);
+
+    receiver_sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    sender_sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (bind(receiver_sock, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        bind(sender_sock, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        getsockname(sender_sock, (struct sockaddr *)&sender_addr, &addr_len) != 0) {
+        perror("unable to set up loopback sockets");
+        return EXIT_FAILURE;
+    }
+
+    RUN_TEST(test_announce_erases_and_requests_everything);
+    RUN_TEST(test_nack_lists_missing_ranges);
+    RUN_TEST(test_nack_range_limit);
+    RUN_TEST(test_blocks_in_any_order_complete_the_image);
+    RUN_TEST(test_completed_image_is_kept_until_restart);
+    RUN_TEST(test_sha256_mismatch_is_rejected);
+    RUN_TEST(test_oversized_image_is_rejected_once);
+    RUN_TEST(test_busy_writer_is_not_a_failure);
+    RUN_TEST(test_silent_sender_times_out);
+    RUN_TEST(test_flash_error_aborts);
+
+    return test_result();
+}
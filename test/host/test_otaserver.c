@@ -0,0 +1,417 @@
+// HTTP upload handler against a scripted request body: timeouts, short reads, disconnects and errors mid-stream and
+// flash failures, each checked for the status the client gets back.
+
+#include <stdio.h>
+
+#include "fake_stream.h"
+#include "otaserver.c"
+#include "test.h"
+
+#define TEST_IMAGE_LEN (40 * 1024 + 5)
+
+// esp_http_server waits this long in httpd_req_recv before HTTPD_SOCK_ERR_TIMEOUT, recv_wait_timeout defaults to 5 s
+#define TEST_RECV_WAIT_TIMEOUT_MS 5000
+
+static uint8_t test_image[TEST_IMAGE_LEN];
+
+static const char *req_query;
+static const char *req_range;
+static const char *resp_status;
+static char resp_content_range[48];
+static ssize_t resp_len;
+static int resp_sends;
+static uint8_t last_event;
+static uint8_t last_reason;
+
+int httpd_req_recv(httpd_req_t *r, char *buf, size_t buf_len) {
+    fake_stream_fault_t fault;
+    long ret;
+
+    ret = fake_stream_read(buf, buf_len, &fault);
+    if (fault == FAKE_STREAM_STALL) {
+        return HTTPD_SOCK_ERR_TIMEOUT;
+    } else if (fault == FAKE_STREAM_ERROR) {
+        return HTTPD_SOCK_ERR_FAIL;
+    }
+
+    return ret;
+}
+
+esp_err_t httpd_resp_set_status(httpd_req_t *r, const char *status) {
+    resp_status = status;
+    return ESP_OK;
+}
+
+esp_err_t httpd_resp_send(httpd_req_t *r, const char *buf, ssize_t buf_len) {
+    resp_sends++;
+    resp_len = buf_len;
+    return ESP_OK;
+}
+
+int httpd_req_to_sockfd(httpd_req_t *r) { return -1; }
+esp_err_t httpd_start(httpd_handle_t *handle, const httpd_config_t *config) { return ESP_OK; }
+esp_err_t httpd_stop(httpd_handle_t handle) { return ESP_OK; }
+esp_err_t httpd_register_uri_handler(httpd_handle_t handle, const httpd_uri_t *uri_handler) { return ESP_OK; }
+esp_err_t httpd_req_get_url_query_str(httpd_req_t *r, char *buf, size_t buf_len) {
+    if (req_query == NULL) {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    snprintf(buf, buf_len, "%s", req_query);
+    return ESP_OK;
+}
+
+// only single key=value queries
+esp_err_t httpd_query_key_value(const char *qry, const char *key, char *val, size_t val_size) {
+    size_t key_len = strlen(key);
+
+    if (strncmp(qry, key, key_len) != 0 || qry[key_len] != '=') {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    snprintf(val, val_size, "%s", qry + key_len + 1);
+    return ESP_OK;
+}
+esp_err_t httpd_req_get_hdr_value_str(httpd_req_t *r, const char *field, char *val, size_t val_size) {
+    if (strcmp(field, "Range") != 0 || req_range == NULL) {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    snprintf(val, val_size, "%s", req_range);
+    return strlen(req_range) < val_size ? ESP_OK : ESP_ERR_HTTPD_RESULT_TRUNC;
+}
+esp_err_t httpd_req_async_handler_begin(httpd_req_t *r, httpd_req_t **out) { return ESP_FAIL; }
+esp_err_t httpd_req_async_handler_complete(httpd_req_t *r) { return ESP_OK; }
+esp_err_t httpd_resp_set_type(httpd_req_t *r, const char *type) { return ESP_OK; }
+esp_err_t httpd_resp_set_hdr(httpd_req_t *r, const char *field, const char *value) {
+    if (strcmp(field, "Content-Range") == 0) {
+        snprintf(resp_content_range, sizeof(resp_content_range), "%s", value);
+    }
+
+    return ESP_OK;
+}
+esp_err_t httpd_resp_send_chunk(httpd_req_t *r, const char *buf, ssize_t buf_len) { return ESP_OK; }
+esp_err_t httpd_resp_sendstr(httpd_req_t *r, const char *str) { return ESP_OK; }
+esp_err_t httpd_resp_sendstr_chunk(httpd_req_t *r, const char *str) { return ESP_OK; }
+
+static void record_event(uint8_t event, uint8_t reason) {
+    if (event != OTA_EVENT_IDLE) {
+        last_event = event;
+        last_reason = reason;
+    }
+}
+
+// POST /ota announcing content_len bytes, the body being the first data_len bytes of the test image
+static httpd_req_t request_reset(size_t content_len, size_t data_len) {
+    httpd_req_t req = {.method = HTTP_POST, .content_len = content_len};
+
+    fake_stream_reset(test_image, data_len, TEST_RECV_WAIT_TIMEOUT_MS);
+
+    host_tasks_enabled = false;
+    resp_status = NULL;
+    resp_sends = 0;
+    last_event = OTA_EVENT_IDLE;
+    last_reason = OTA_FAILURE_NONE;
+    otaserver_event_cb = record_event;
+
+    return req;
+}
+
+static void expect_failure(httpd_req_t *req, uint8_t reason, const char *status) {
+    char name[64];
+    long before;
+
+    snprintf(name, sizeof(name), "ota_failures_total{reason=\"%s\"}", metrics_failure_name(reason));
+    before = test_metric(name);
+
+    CHECK_INT(ota_post_handler(req), ESP_FAIL);
+
+    CHECK_STR(resp_status, status);
+    CHECK_INT(resp_sends, 1);
+    CHECK_INT(last_event, OTA_EVENT_FAILED);
+    CHECK_INT(last_reason, reason);
+    CHECK_INT(test_metric(name), before + 1);
+    CHECK(host_boot_partition == NULL);
+    CHECK_STR(host_last_task, "");
+}
+
+static void test_update(void) {
+    httpd_req_t req = request_reset(TEST_IMAGE_LEN, TEST_IMAGE_LEN);
+
+    CHECK_INT(ota_post_handler(&req), ESP_OK);
+    CHECK_STR(resp_status, HTTPD_202);
+    CHECK_INT(last_event, OTA_EVENT_SUCCESS);
+    CHECK(memcmp(host_flash, test_image, TEST_IMAGE_LEN) == 0);
+    CHECK(host_boot_partition != NULL);
+    CHECK_STR(host_last_task, "esp_restart_task");
+    CHECK(!ota_writer_is_busy());
+}
+
+static void test_update_with_short_reads_and_timeouts(void) {
+    httpd_req_t req = request_reset(TEST_IMAGE_LEN, TEST_IMAGE_LEN);
+
+    // far shorter than the image header, which has to be put together from several reads
+    fake_stream.max_read = 100;
+    fake_stream.ms_per_read = 20;
+
+    CHECK_INT(ota_post_handler(&req), ESP_OK);
+    CHECK_STR(resp_status, HTTPD_202);
+    CHECK(memcmp(host_flash, test_image, TEST_IMAGE_LEN) == 0);
+}
+
+static void test_update_with_single_byte_reads(void) {
+    httpd_req_t req = request_reset(TEST_IMAGE_LEN, TEST_IMAGE_LEN);
+
+    fake_stream.max_read = 1;
+
+    CHECK_INT(ota_post_handler(&req), ESP_OK);
+    CHECK_STR(resp_status, HTTPD_202);
+    CHECK(memcmp(host_flash, test_image, TEST_IMAGE_LEN) == 0);
+}
+
+static void test_timeouts_within_the_header(void) {
+    httpd_req_t req = request_reset(TEST_IMAGE_LEN, TEST_IMAGE_LEN);
+
+    // the bytes of the header read before the timeouts must not get lost
+    fake_stream.max_read = 50;
+    fake_stream.fault_at = 150;
+    fake_stream.fault = FAKE_STREAM_STALL;
+    fake_stream.fault_reads = 2;
+
+    CHECK_INT(ota_post_handler(&req), ESP_OK);
+    CHECK_STR(resp_status, HTTPD_202);
+    CHECK(memcmp(host_flash, test_image, TEST_IMAGE_LEN) == 0);
+}
+
+static void test_body_shorter_than_header(void) {
+    httpd_req_t req = request_reset(OTA_WRITER_HEADER_LEN - 1, OTA_WRITER_HEADER_LEN - 1);
+
+    fake_stream.max_read = 10;
+
+    expect_failure(&req, OTA_FAILURE_INVALID_IMAGE, HTTPD_400);
+    CHECK_INT(fake_stream.pos, 0);
+}
+
+static void test_staged_update(void) {
+    httpd_req_t req = request_reset(TEST_IMAGE_LEN, TEST_IMAGE_LEN);
+
+    host_psram_size = HOST_PARTITION_SIZE;
+
+    CHECK_INT(ota_post_handler(&req), ESP_OK);
+    CHECK_STR(resp_status, HTTPD_202);
+    CHECK_INT(host_ota_begin_calls, 1);
+    CHECK(memcmp(host_flash, test_image, TEST_IMAGE_LEN) == 0);
+}
+
+static void test_stall(void) {
+    httpd_req_t req = request_reset(TEST_IMAGE_LEN, TEST_IMAGE_LEN);
+
+    fake_stream.fault_at = 12345;
+    fake_stream.fault = FAKE_STREAM_STALL;
+
+    expect_failure(&req, OTA_FAILURE_STALL, HTTPD_408);
+}
+
+static void test_slow_client(void) {
+    // 1000 bytes a second never stalls but stays below OTA_THROUGHPUT_MIN_BPS
+    httpd_req_t req = request_reset(TEST_IMAGE_LEN, TEST_IMAGE_LEN);
+
+    fake_stream.max_read = 1000;
+    fake_stream.ms_per_read = 1000;
+
+    expect_failure(&req, OTA_FAILURE_SLOW_CLIENT, HTTPD_408);
+}
+
+static void test_disconnect(void) {
+    httpd_req_t req = request_reset(TEST_IMAGE_LEN, TEST_IMAGE_LEN - 1);
+
+    expect_failure(&req, OTA_FAILURE_SHORT_BODY, HTTPD_400);
+}
+
+static void test_staged_disconnect_keeps_flash(void) {
+    httpd_req_t req = request_reset(TEST_IMAGE_LEN, TEST_IMAGE_LEN / 3);
+
+    host_psram_size = HOST_PARTITION_SIZE;
+
+    expect_failure(&req, OTA_FAILURE_SHORT_BODY, HTTPD_400);
+    CHECK_INT(host_ota_begin_calls, 0);
+}
+
+static void test_recv_error(void) {
+    httpd_req_t req = request_reset(TEST_IMAGE_LEN, TEST_IMAGE_LEN);
+
+    fake_stream.fault_at = 2048;
+    fake_stream.fault = FAKE_STREAM_ERROR;
+
+    expect_failure(&req, OTA_FAILURE_RECV_ERROR, HTTPD_400);
+}
+
+static void test_flash_write_error(void) {
+    httpd_req_t req = request_reset(TEST_IMAGE_LEN, TEST_IMAGE_LEN);
+
+    host_ota_write_fail_at = 3;
+
+    expect_failure(&req, OTA_FAILURE_FLASH_ERROR, HTTPD_500);
+}
+
+static void test_flash_end_error(void) {
+    httpd_req_t req = request_reset(TEST_IMAGE_LEN, TEST_IMAGE_LEN);
+
+    host_ota_end_result = ESP_ERR_FLASH_OP_FAIL;
+
+    expect_failure(&req, OTA_FAILURE_FLASH_ERROR, HTTPD_500);
+}
+
+static void test_invalid_image(void) {
+    httpd_req_t req = request_reset(TEST_IMAGE_LEN, TEST_IMAGE_LEN);
+
+    host_ota_end_result = ESP_ERR_OTA_VALIDATE_FAILED;
+
+    expect_failure(&req, OTA_FAILURE_INVALID_IMAGE, HTTPD_400);
+}
+
+static void test_image_too_large(void) {
+    httpd_req_t req = request_reset(HOST_PARTITION_SIZE + 1, 0);
+
+    expect_failure(&req, OTA_FAILURE_INVALID_IMAGE, HTTPD_400);
+    CHECK_INT(host_ota_begin_calls, 0);
+}
+
+static void test_busy(void) {
+    ota_writer_t upload;
+
+    CHECK_INT(ota_writer_begin(&upload), ESP_OK);
+    httpd_req_t req = request_reset(TEST_IMAGE_LEN, TEST_IMAGE_LEN);
+
+    CHECK_INT(ota_post_handler(&req), ESP_FAIL);
+    CHECK_STR(resp_status, HTTPD_503);
+    CHECK_INT(last_event, OTA_EVENT_FAILED);
+    CHECK_INT(last_reason, OTA_FAILURE_BUSY);
+    CHECK_INT(test_metric("ota_failures_total{reason=\"busy\"}"), 1);
+    CHECK_INT(fake_stream.pos, 0);
+    CHECK(ota_writer_is_busy());
+
+    ota_writer_abort(&upload, OTA_FAILURE_SHORT_BODY);
+}
+
+// one line through the hook logbuf installed, as esp_log would
+static void log_line(const char *format, ...) {
+    va_list args;
+
+    va_start(args, format);
+    (*host_log_vprintf)(format, args);
+    va_end(args);
+}
+
+static void test_logs_since(void) {
+    httpd_req_t req = {.method = HTTP_GET};
+    char line[LOGBUF_LINE_SIZE];
+    uint32_t seq;
+    int i;
+
+    logbuf_init();
+    for (i = 0; i < LOGBUF_LINES + 10; i++) {
+        log_line("line %d\n", i);
+    }
+
+    req_query = NULL;
+    CHECK_INT(logs_get_since(&req), logbuf_tail());
+
+    req_query = "since=70";
+    CHECK_INT(logs_get_since(&req), 70);
+
+    // a sequence number from before a restart starts over with what is held instead of waiting for it
+    req_query = "since=5000";
+    seq = logs_get_since(&req);
+    CHECK_INT(seq, logbuf_tail());
+    CHECK_INT(logbuf_read(&seq, line, sizeof(line)), LOGBUF_READ_OK);
+    CHECK_STR(line, "line 10");
+
+    req_query = NULL;
+}
+
+static void test_partition_ranges(void) {
+    static const struct {
+        const char *range;
+        const char *status;
+        ssize_t len;
+        const char *content_range;
+    } cases[] = {
+        {NULL, HTTPD_200, 1000, ""},
+        {"bytes=0-9", HTTPD_206, 10, "bytes 0-9/1000"},
+        {"bytes=990-", HTTPD_206, 10, "bytes 990-999/1000"},
+        {"bytes=-10", HTTPD_206, 10, "bytes 990-999/1000"},
+        {"bytes=-5000", HTTPD_206, 1000, "bytes 0-999/1000"},
+        {"bytes=500-5000", HTTPD_206, 500, "bytes 500-999/1000"},
+        {"bytes=999-999", HTTPD_206, 1, "bytes 999-999/1000"},
+        // unsatisfiable
+        {"bytes=1000-", HTTPD_416, 0, "bytes */1000"},
+        {"bytes=1000-2000", HTTPD_416, 0, "bytes */1000"},
+        {"bytes=-0", HTTPD_416, 0, "bytes */1000"},
+        // ignored, the whole image
+        {"bytes=5-3", HTTPD_200, 1000, ""},
+        {"bytes=0-1,5-6", HTTPD_200, 1000, ""},
+        {"items=0-9", HTTPD_200, 1000, ""},
+        {"bytes=", HTTPD_200, 1000, ""},
+        {"bytes=0-9                                                        ", HTTPD_200, 1000, ""},
+    };
+    httpd_req_t req = {.method = HTTP_GET};
+    size_t i;
+
+    host_image_len = 1000;
+
+    for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        req_range = cases[i].range;
+        resp_status = NULL;
+        resp_content_range[0] = '\0';
+        resp_len = -1;
+
+        CHECK_INT(partition_get_handler(&req), ESP_OK);
+        CHECK_STR(resp_status, cases[i].status);
+        CHECK_INT(resp_len, cases[i].len);
+        CHECK_STR(resp_content_range, cases[i].content_range);
+    }
+
+    req_range = NULL;
+}
+
+static void test_failure_status(void) {
+    static const char *expected[OTA_FAILURE_COUNT] = {
+        [OTA_FAILURE_STALL] = HTTPD_408,       [OTA_FAILURE_SLOW_CLIENT] = HTTPD_408,
+        [OTA_FAILURE_SHORT_BODY] = HTTPD_400,  [OTA_FAILURE_RECV_ERROR] = HTTPD_400,
+        [OTA_FAILURE_FLASH_ERROR] = HTTPD_500, [OTA_FAILURE_INVALID_IMAGE] = HTTPD_400,
+        [OTA_FAILURE_BUSY] = HTTPD_503,
+    };
+    uint8_t reason;
+
+    for (reason = OTA_FAILURE_NONE + 1; reason < OTA_FAILURE_COUNT; reason++) {
+        CHECK(expected[reason] != NULL);
+        CHECK_STR(ota_failure_status(reason), expected[reason]);
+    }
+}
+
+int main(void) {
+    test_make_image(test_image, sizeof(test_image));
+
+    RUN_TEST(test_update);
+    RUN_TEST(test_update_with_short_reads_and_timeouts);
+    RUN_TEST(test_update_with_single_byte_reads);
+    RUN_TEST(test_timeouts_within_the_header);
+    RUN_TEST(test_body_shorter_than_header);
+    RUN_TEST(test_staged_update);
+    RUN_TEST(test_stall);
+    RUN_TEST(test_slow_client);
+    RUN_TEST(test_disconnect);
+    RUN_TEST(test_staged_disconnect_keeps_flash);
+    RUN_TEST(test_recv_error);
+    RUN_TEST(test_flash_write_error);
+    RUN_TEST(test_flash_end_error);
+    RUN_TEST(test_invalid_image);
+    RUN_TEST(test_image_too_large);
+    RUN_TEST(test_busy);
+    RUN_TEST(test_logs_since);
+    RUN_TEST(test_partition_ranges);
+    RUN_TEST(test_failure_status);
+
+    return test_result();
+}
@@ -0,0 +1,307 @@
+// Raw TCP receiver against a scripted client: timeouts, short reads, disconnects and errors mid-stream and flash
+// failures, each checked for the ERR reason the client gets back.
+
+#include <stdio.h>
+
+#include "fake_stream.h"
+#include "lwip/sockets.h"
+
+static ssize_t test_recv(int sock, void *buf, size_t len, int flags);
+static ssize_t test_send(int sock, const void *buf, size_t len, int flags);
+
+#define recv test_recv
+#define send test_send
+#include "otatcp.c"
+#undef recv
+#undef send
+
+#include "test.h"
+
+#define TEST_IMAGE_LEN (48 * 1024 + 17)
+#define TEST_SOCK 42
+
+static uint8_t test_image[TEST_IMAGE_LEN];
+static uint8_t test_sha256[OTA_WRITER_SHA256_LEN];
+
+// header line followed by the image, as the client sends it
+static uint8_t client_data[OTA_TCP_HEADER_MAXLEN + TEST_IMAGE_LEN];
+static size_t client_header_len;
+
+static char replies[256];
+static uint8_t last_event;
+static uint8_t last_reason;
+
+static ssize_t test_recv(int sock, void *buf, size_t len, int flags) {
+    fake_stream_fault_t fault;
+    long ret;
+
+    CHECK_INT(sock, TEST_SOCK);
+
+    ret = fake_stream_read(buf, len, &fault);
+    if (fault == FAKE_STREAM_STALL) {
+        errno = EAGAIN;
+    } else if (fault == FAKE_STREAM_ERROR) {
+        errno = ECONNRESET;
+    }
+
+    return ret;
+}
+
+static ssize_t test_send(int sock, const void *buf, size_t len, int flags) {
+    size_t used = strlen(replies);
+
+    snprintf(replies + used, sizeof(replies) - used, "%.*s", (int)len, (const char *)buf);
+    return len;
+}
+
+static void record_event(uint8_t event, uint8_t reason) {
+    if (event != OTA_EVENT_IDLE) {
+        last_event = event;
+        last_reason = reason;
+    }
+}
+
+// client announcing image_len bytes with the hash of the test image, sending data_len bytes of it
+static void client_reset(size_t image_len, size_t data_len) {
+    char sha256_hex[OTA_WRITER_SHA256_LEN * 2 + 1];
+    size_t i;
+
+    for (i = 0; i < OTA_WRITER_SHA256_LEN; i++) {
+        sprintf(&sha256_hex[i * 2], "%02x", test_sha256[i]);
+    }
+
+    client_header_len = snprintf((char *)client_data, OTA_TCP_HEADER_MAXLEN, "OTA %zu %s ota_0\r\n", image_len,
+                                 sha256_hex);
+    memcpy(client_data + client_header_len, test_image, data_len);
+
+    fake_stream_reset(client_data, client_header_len + data_len, OTA_TCP_RECV_TIMEOUT_MS);
+
+    replies[0] = '\0';
+    last_event = OTA_EVENT_IDLE;
+    last_reason = OTA_FAILURE_NONE;
+    otatcp_event_cb = record_event;
+}
+
+static void expect_failure(uint8_t reason, const char *reply) {
+    char name[64];
+    long before;
+
+    snprintf(name, sizeof(name), "ota_failures_total{reason=\"%s\"}", metrics_failure_name(reason));
+    before = test_metric(name);
+
+    CHECK(otatcp_handle_client(TEST_SOCK) != ESP_OK);
+
+    CHECK_STR(replies, reply);
+    CHECK_INT(last_event, OTA_EVENT_FAILED);
+    CHECK_INT(last_reason, reason);
+    CHECK_INT(test_metric(name), before + 1);
+    CHECK(host_boot_partition == NULL);
+    CHECK(!ota_writer_is_busy());
+}
+
+static void test_update(void) {
+    client_reset(TEST_IMAGE_LEN, TEST_IMAGE_LEN);
+
+    CHECK_INT(otatcp_handle_client(TEST_SOCK), ESP_OK);
+    CHECK_STR(replies, "OK\nOK\n");
+    CHECK(memcmp(host_flash, test_image, TEST_IMAGE_LEN) == 0);
+    CHECK(host_boot_partition != NULL);
+    CHECK(!ota_writer_is_busy());
+}
+
+static void test_update_with_short_reads_and_timeouts(void) {
+    client_reset(TEST_IMAGE_LEN, TEST_IMAGE_LEN);
+    fake_stream.max_read = 333;
+    fake_stream.ms_per_read = 100;
+
+    CHECK_INT(otatcp_handle_client(TEST_SOCK), ESP_OK);
+    CHECK_STR(replies, "OK\nOK\n");
+    CHECK(memcmp(host_flash, test_image, TEST_IMAGE_LEN) == 0);
+}
+
+static void test_staged_update(void) {
+    host_psram_size = HOST_PARTITION_SIZE;
+    client_reset(TEST_IMAGE_LEN, TEST_IMAGE_LEN);
+
+    CHECK_INT(otatcp_handle_client(TEST_SOCK), ESP_OK);
+    CHECK_STR(replies, "OK\nOK\n");
+    CHECK_INT(host_ota_begin_calls, 1);
+    CHECK(memcmp(host_flash, test_image, TEST_IMAGE_LEN) == 0);
+}
+
+static void test_stall_mid_stream(void) {
+    client_reset(TEST_IMAGE_LEN, TEST_IMAGE_LEN);
+    fake_stream.fault_at = client_header_len + 20000;
+    fake_stream.fault = FAKE_STREAM_STALL;
+
+    expect_failure(OTA_FAILURE_STALL, "OK\nERR stall\n");
+}
+
+static void test_slow_client(void) {
+    // 300 bytes a second never stalls but stays below OTA_THROUGHPUT_MIN_BPS
+    client_reset(TEST_IMAGE_LEN, TEST_IMAGE_LEN);
+    fake_stream.max_read = 300;
+    fake_stream.ms_per_read = 1000;
+
+    expect_failure(OTA_FAILURE_SLOW_CLIENT, "OK\nERR slow_client\n");
+}
+
+static void test_disconnect_mid_stream(void) {
+    client_reset(TEST_IMAGE_LEN, TEST_IMAGE_LEN / 2);
+
+    expect_failure(OTA_FAILURE_SHORT_BODY, "OK\nERR short_body\n");
+}
+
+static void test_staged_disconnect_keeps_flash(void) {
+    host_psram_size = HOST_PARTITION_SIZE;
+    client_reset(TEST_IMAGE_LEN, TEST_IMAGE_LEN / 2);
+
+    expect_failure(OTA_FAILURE_SHORT_BODY, "OK\nERR short_body\n");
+    CHECK_INT(host_ota_begin_calls, 0);
+}
+
+static void test_recv_error(void) {
+    client_reset(TEST_IMAGE_LEN, TEST_IMAGE_LEN);
+    fake_stream.fault_at = client_header_len + 4096;
+    fake_stream.fault = FAKE_STREAM_ERROR;
+
+    expect_failure(OTA_FAILURE_RECV_ERROR, "OK\nERR recv_error\n");
+}
+
+static void test_flash_write_error(void) {
+    client_reset(TEST_IMAGE_LEN, TEST_IMAGE_LEN);
+    host_ota_write_fail_at = 4;
+
+    expect_failure(OTA_FAILURE_FLASH_ERROR, "OK\nERR flash_error\n");
+}
+
+static void test_sha256_mismatch(void) {
+    client_reset(TEST_IMAGE_LEN, TEST_IMAGE_LEN);
+    client_data[client_header_len + 1000] ^= 0xff;
+
+    expect_failure(OTA_FAILURE_INVALID_IMAGE, "OK\nERR invalid_image\n");
+}
+
+static void test_image_too_large(void) {
+    client_reset(HOST_PARTITION_SIZE + 1, 0);
+
+    expect_failure(OTA_FAILURE_INVALID_IMAGE, "ERR invalid_image\n");
+}
+
+static void test_busy(void) {
+    ota_writer_t upload;
+
+    CHECK_INT(ota_writer_begin(&upload), ESP_OK);
+    client_reset(TEST_IMAGE_LEN, TEST_IMAGE_LEN);
+
+    CHECK(otatcp_handle_client(TEST_SOCK) != ESP_OK);
+    CHECK_STR(replies, "ERR busy\n");
+    CHECK_INT(last_event, OTA_EVENT_FAILED);
+    CHECK_INT(last_reason, OTA_FAILURE_BUSY);
+    CHECK_INT(test_metric("ota_failures_total{reason=\"busy\"}"), 1);
+    CHECK_INT(host_ota_begin_calls, 0);
+    CHECK(ota_writer_is_busy());
+
+    ota_writer_abort(&upload, OTA_FAILURE_SHORT_BODY);
+}
+
+static void test_header_timeout(void) {
+    client_reset(TEST_IMAGE_LEN, TEST_IMAGE_LEN);
+    fake_stream.fault_at = 5;
+    fake_stream.fault = FAKE_STREAM_STALL;
+
+    CHECK_INT(otatcp_handle_client(TEST_SOCK), ESP_ERR_TIMEOUT);
+    CHECK_STR(replies, "ERR header\n");
+    CHECK_INT(host_ota_begin_calls, 0);
+}
+
+static void test_malformed_header(void) {
+    static const char *headers[] = {"OTA\n", "OTA 100\n", "OTA 100 abcd\n", "PUT 100 00\n",
+                                    "OTA 100 0000000000000000000000000000000000000000000000000000000000000000 ota_1\n"};
+    size_t i;
+
+    for (i = 0; i < sizeof(headers) / sizeof(headers[0]); i++) {
+        client_reset(0, 0);
+        fake_stream_reset(headers[i], strlen(headers[i]), OTA_TCP_RECV_TIMEOUT_MS);
+
+        CHECK(otatcp_handle_client(TEST_SOCK) != ESP_OK);
+        CHECK(strncmp(replies, "ERR ", 4) == 0);
+    }
+
+    CHECK_INT(host_ota_begin_calls, 0);
+}
+
+static void test_read_full_reasons(void) {
+    ota_writer_t writer;
+    char buf[64];
+
+    CHECK_INT(ota_writer_begin(&writer), ESP_OK);
+
+    fake_stream_reset(test_image, sizeof(buf), OTA_TCP_RECV_TIMEOUT_MS);
+    fake_stream.max_read = 1;
+    CHECK_INT(otatcp_read_full(TEST_SOCK, &writer, buf, sizeof(buf)), OTA_FAILURE_NONE);
+    CHECK(memcmp(buf, test_image, sizeof(buf)) == 0);
+
+    fake_stream_reset(test_image, sizeof(buf) - 1, OTA_TCP_RECV_TIMEOUT_MS);
+    CHECK_INT(otatcp_read_full(TEST_SOCK, &writer, buf, sizeof(buf)), OTA_FAILURE_SHORT_BODY);
+
+    fake_stream_reset(test_image, sizeof(buf), OTA_TCP_RECV_TIMEOUT_MS);
+    fake_stream.fault_at = 10;
+    fake_stream.fault = FAKE_STREAM_ERROR;
+    CHECK_INT(otatcp_read_full(TEST_SOCK, &writer, buf, sizeof(buf)), OTA_FAILURE_RECV_ERROR);
+
+    fake_stream_reset(test_image, sizeof(buf), OTA_TCP_RECV_TIMEOUT_MS);
+    fake_stream.fault_at = 10;
+    fake_stream.fault = FAKE_STREAM_STALL;
+    CHECK_INT(otatcp_read_full(TEST_SOCK, &writer, buf, sizeof(buf)), OTA_FAILURE_STALL);
+
+    ota_writer_abort(&writer, OTA_FAILURE_STALL);
+}
+
+static void test_failure_replies(void) {
+    static const char *expected[OTA_FAILURE_COUNT] = {
+        [OTA_FAILURE_STALL] = "ERR stall\n",
+        [OTA_FAILURE_SLOW_CLIENT] = "ERR slow_client\n",
+        [OTA_FAILURE_SHORT_BODY] = "ERR short_body\n",
+        [OTA_FAILURE_RECV_ERROR] = "ERR recv_error\n",
+        [OTA_FAILURE_FLASH_ERROR] = "ERR flash_error\n",
+        [OTA_FAILURE_INVALID_IMAGE] = "ERR invalid_image\n",
+        [OTA_FAILURE_BUSY] = "ERR busy\n",
+    };
+    uint8_t reason;
+
+    for (reason = OTA_FAILURE_NONE + 1; reason < OTA_FAILURE_COUNT; reason++) {
+        client_reset(0, 0);
+
+        CHECK_INT(otatcp_fail(TEST_SOCK, reason), ESP_FAIL);
+        CHECK(expected[reason] != NULL);
+        CHECK_STR(replies, expected[reason]);
+        CHECK_INT(last_reason, reason);
+    }
+}
+
+int main(void) {
+    test_make_image(test_image, sizeof(test_image));
+    mbedtls_sha256(test_image, sizeof(test_image), test_sha256, 0);
+
+    host_stubs_reset();
+
+    RUN_TEST(test_update);
+    RUN_TEST(test_update_with_short_reads_and_timeouts);
+    RUN_TEST(test_staged_update);
+    RUN_TEST(test_stall_mid_stream);
+    RUN_TEST(test_slow_client);
+    RUN_TEST(test_disconnect_mid_stream);
+    RUN_TEST(test_staged_disconnect_keeps_flash);
+    RUN_TEST(test_recv_error);
+    RUN_TEST(test_flash_write_error);
+    RUN_TEST(test_sha256_mismatch);
+    RUN_TEST(test_image_too_large);
+    RUN_TEST(test_busy);
+    RUN_TEST(test_header_timeout);
+    RUN_TEST(test_malformed_header);
+    RUN_TEST(test_read_full_reasons);
+    RUN_TEST(test_failure_replies);
+
+    return test_result();
+}
@@ -0,0 +1,395 @@
+// OTA session state shared by all receivers: progress watchdog, flash and image failures, streaming and PSRAM
+// staging. Every failure has to release the partition and land in the matching /metrics counter.
+
+#include "otawriter.h"
+
+#include <sys/param.h>
+
+#include "test.h"
+
+#define TEST_IMAGE_LEN (64 * 1024 + 100)
+
+static uint8_t test_image[TEST_IMAGE_LEN];
+static uint8_t test_sha256[OTA_WRITER_SHA256_LEN];
+
+static long failures(const char *reason) {
+    char name[64];
+
+    snprintf(name, sizeof(name), "ota_failures_total{reason=\"%s\"}", reason);
+    return test_metric(name);
+}
+
+// write the image in chunks of chunk_size, stops at the first error
+static esp_err_t write_image(ota_writer_t *writer, const uint8_t *image, size_t len, size_t chunk_size) {
+    esp_err_t err = ESP_OK;
+    size_t offset;
+
+    for (offset = 0; offset < len && err == ESP_OK; offset += chunk_size) {
+        err = ota_writer_write(writer, image + offset, MIN(chunk_size, len - offset));
+    }
+
+    return err;
+}
+
+static void test_progress_ok_while_data_flows(void) {
+    ota_writer_t writer;
+    int i;
+
+    CHECK_INT(ota_writer_begin(&writer), ESP_OK);
+    CHECK_INT(ota_writer_check_progress(&writer), OTA_FAILURE_NONE);
+
+    // 4 KiB/s for a couple of windows stays above OTA_THROUGHPUT_MIN_BPS
+    CHECK_INT(ota_writer_write(&writer, test_image, 4096), ESP_OK);
+    for (i = 1; i < 40; i++) {
+        host_advance_time_ms(1000);
+        CHECK_INT(ota_writer_write(&writer, test_image + i * 1024, 4096), ESP_OK);
+        CHECK_INT(ota_writer_check_progress(&writer), OTA_FAILURE_NONE);
+    }
+
+    ota_writer_abort(&writer, OTA_FAILURE_SHORT_BODY);
+}
+
+static void test_progress_stall(void) {
+    ota_writer_t writer;
+    long stalls = failures("stall");
+
+    CHECK_INT(ota_writer_begin(&writer), ESP_OK);
+    CHECK_INT(write_image(&writer, test_image, TEST_IMAGE_LEN, 4096), ESP_OK);
+
+    // a healthy first window, then the connection goes silent
+    host_advance_time_ms(OTA_THROUGHPUT_WINDOW_MS);
+    CHECK_INT(ota_writer_check_progress(&writer), OTA_FAILURE_NONE);
+
+    host_advance_time_ms(OTA_STALL_TIMEOUT_MS - OTA_THROUGHPUT_WINDOW_MS - 1);
+    CHECK_INT(ota_writer_check_progress(&writer), OTA_FAILURE_NONE);
+
+    host_advance_time_ms(2);
+    CHECK_INT(ota_writer_check_progress(&writer), OTA_FAILURE_STALL);
+
+    // the receiver aborts with the reason it was handed
+    ota_writer_abort(&writer, OTA_FAILURE_STALL);
+    CHECK_INT(failures("stall"), stalls + 1);
+    CHECK_INT(host_ota_abort_calls, 1);
+    CHECK(!ota_writer_is_busy());
+}
+
+static void test_progress_silent_client_stalls(void) {
+    ota_writer_t writer;
+
+    CHECK_INT(ota_writer_begin(&writer), ESP_OK);
+
+    // an empty throughput window is not judged, the stall timeout reports it
+    host_advance_time_ms(OTA_THROUGHPUT_WINDOW_MS + 1);
+    CHECK_INT(ota_writer_check_progress(&writer), OTA_FAILURE_NONE);
+
+    host_advance_time_ms(OTA_STALL_TIMEOUT_MS - OTA_THROUGHPUT_WINDOW_MS);
+    CHECK_INT(ota_writer_check_progress(&writer), OTA_FAILURE_STALL);
+
+    ota_writer_abort(&writer, OTA_FAILURE_STALL);
+}
+
+static void test_progress_slow_client(void) {
+    ota_writer_t writer;
+    size_t offset = 0;
+    uint8_t reason = OTA_FAILURE_NONE;
+    int seconds;
+
+    CHECK_INT(ota_writer_begin(&writer), ESP_OK);
+    CHECK_INT(ota_writer_write(&writer, test_image, OTA_WRITER_HEADER_LEN), ESP_OK);
+    offset = OTA_WRITER_HEADER_LEN;
+
+    // a trickle of 1 KiB/s never stalls but has to be cut off at the end of the first window
+    for (seconds = 1; seconds <= OTA_THROUGHPUT_WINDOW_MS / 1000 + 1 && reason == OTA_FAILURE_NONE; seconds++) {
+        host_advance_time_ms(1000);
+        CHECK_INT(ota_writer_write(&writer, test_image + offset, 1024), ESP_OK);
+        offset += 1024;
+        reason = ota_writer_check_progress(&writer);
+    }
+
+    CHECK_INT(reason, OTA_FAILURE_SLOW_CLIENT);
+    CHECK_INT(seconds - 1, OTA_THROUGHPUT_WINDOW_MS / 1000);
+
+    ota_writer_abort(&writer, reason);
+    CHECK(!ota_writer_is_busy());
+}
+
+static void test_streamed_image(void) {
+    ota_writer_t writer;
+    long successes = test_metric("ota_success_total");
+
+    CHECK_INT(ota_writer_begin(&writer), ESP_OK);
+    CHECK(!ota_writer_stage(&writer, TEST_IMAGE_LEN));
+    CHECK_INT(write_image(&writer, test_image, TEST_IMAGE_LEN, 1000), ESP_OK);
+    CHECK_INT(ota_writer_end(&writer, test_sha256), ESP_OK);
+    CHECK_INT(ota_writer_activate(&writer), ESP_OK);
+
+    CHECK(memcmp(host_flash, test_image, TEST_IMAGE_LEN) == 0);
+    CHECK(host_boot_partition == writer.partition);
+    CHECK_INT(test_metric("ota_success_total"), successes + 1);
+    CHECK_INT(test_metric("ota_last_bytes"), TEST_IMAGE_LEN);
+    CHECK(!ota_writer_is_busy());
+}
+
+static void test_busy(void) {
+    ota_writer_t first;
+    ota_writer_t second;
+    long busy = failures("busy");
+
+    CHECK_INT(ota_writer_begin(&first), ESP_OK);
+    CHECK(ota_writer_is_busy());
+
+    CHECK_INT(ota_writer_begin(&second), ESP_ERR_INVALID_STATE);
+    CHECK_INT(second.failure, OTA_FAILURE_BUSY);
+    CHECK_INT(failures("busy"), busy + 1);
+
+    // the refused session must not release the claim of the running one
+    ota_writer_abort(&second, OTA_FAILURE_RECV_ERROR);
+    CHECK(ota_writer_is_busy());
+
+    ota_writer_abort(&first, OTA_FAILURE_RECV_ERROR);
+    CHECK(!ota_writer_is_busy());
+}
+
+static void test_short_first_chunk(void) {
+    ota_writer_t writer;
+    long invalid = failures("invalid_image");
+
+    CHECK_INT(ota_writer_begin(&writer), ESP_OK);
+    CHECK(ota_writer_write(&writer, test_image, OTA_WRITER_HEADER_LEN - 1) != ESP_OK);
+    CHECK_INT(writer.failure, OTA_FAILURE_INVALID_IMAGE);
+    CHECK_INT(failures("invalid_image"), invalid + 1);
+    CHECK_INT(host_ota_begin_calls, 0);
+    CHECK(!ota_writer_is_busy());
+}
+
+static void test_flash_write_error(void) {
+    ota_writer_t writer;
+    long flash_errors = failures("flash_error");
+
+    host_ota_write_fail_at = 3;
+
+    CHECK_INT(ota_writer_begin(&writer), ESP_OK);
+    CHECK(write_image(&writer, test_image, TEST_IMAGE_LEN, 1024) != ESP_OK);
+    CHECK_INT(writer.failure, OTA_FAILURE_FLASH_ERROR);
+    CHECK_INT(writer.written, 2 * 1024);
+    CHECK_INT(failures("flash_error"), flash_errors + 1);
+    CHECK_INT(host_ota_abort_calls, 1);
+    CHECK(!ota_writer_is_busy());
+}
+
+static void test_end_without_data(void) {
+    ota_writer_t writer;
+    long short_bodies = failures("short_body");
+
+    CHECK_INT(ota_writer_begin(&writer), ESP_OK);
+    CHECK(ota_writer_end(&writer, NULL) != ESP_OK);
+    CHECK_INT(writer.failure, OTA_FAILURE_SHORT_BODY);
+    CHECK_INT(failures("short_body"), short_bodies + 1);
+    CHECK(!ota_writer_is_busy());
+}
+
+static void test_sha256_mismatch(void) {
+    ota_writer_t writer;
+    uint8_t wrong_sha256[OTA_WRITER_SHA256_LEN] = {0};
+    long invalid = failures("invalid_image");
+
+    CHECK_INT(ota_writer_begin(&writer), ESP_OK);
+    CHECK_INT(write_image(&writer, test_image, TEST_IMAGE_LEN, 4096), ESP_OK);
+    CHECK_INT(ota_writer_end(&writer, wrong_sha256), ESP_ERR_INVALID_CRC);
+    CHECK_INT(writer.failure, OTA_FAILURE_INVALID_IMAGE);
+    CHECK_INT(failures("invalid_image"), invalid + 1);
+    CHECK(host_boot_partition == NULL);
+    CHECK(!ota_writer_is_busy());
+}
+
+static void test_image_validation_failure(void) {
+    ota_writer_t writer;
+    long invalid = failures("invalid_image");
+
+    host_ota_end_result = ESP_ERR_OTA_VALIDATE_FAILED;
+
+    CHECK_INT(ota_writer_begin(&writer), ESP_OK);
+    CHECK_INT(write_image(&writer, test_image, TEST_IMAGE_LEN, 4096), ESP_OK);
+    CHECK_INT(ota_writer_end(&writer, NULL), ESP_ERR_OTA_VALIDATE_FAILED);
+    CHECK_INT(writer.failure, OTA_FAILURE_INVALID_IMAGE);
+    CHECK_INT(failures("invalid_image"), invalid + 1);
+    CHECK(!ota_writer_is_busy());
+}
+
+static void test_ota_end_flash_error(void) {
+    ota_writer_t writer;
+    long flash_errors = failures("flash_error");
+
+    host_ota_end_result = ESP_ERR_FLASH_OP_FAIL;
+
+    CHECK_INT(ota_writer_begin(&writer), ESP_OK);
+    CHECK_INT(write_image(&writer, test_image, TEST_IMAGE_LEN, 4096), ESP_OK);
+    CHECK(ota_writer_end(&writer, NULL) != ESP_OK);
+    CHECK_INT(writer.failure, OTA_FAILURE_FLASH_ERROR);
+    CHECK_INT(failures("flash_error"), flash_errors + 1);
+    CHECK(!ota_writer_is_busy());
+}
+
+static void test_prepare_rejects_oversized_image(void) {
+    ota_writer_t writer;
+
+    CHECK_INT(ota_writer_begin(&writer), ESP_OK);
+    CHECK_INT(ota_writer_prepare(&writer, HOST_PARTITION_SIZE + 1), ESP_ERR_INVALID_SIZE);
+    CHECK_INT(writer.failure, OTA_FAILURE_INVALID_IMAGE);
+    CHECK_INT(host_ota_begin_calls, 0);
+    CHECK(!ota_writer_is_busy());
+}
+
+static void test_staged_image(void) {
+    ota_writer_t writer;
+
+    host_psram_size = HOST_PARTITION_SIZE;
+
+    CHECK_INT(ota_writer_begin(&writer), ESP_OK);
+    CHECK(ota_writer_stage(&writer, TEST_IMAGE_LEN));
+    CHECK_INT(write_image(&writer, test_image, TEST_IMAGE_LEN, 1000), ESP_OK);
+
+    // nothing touches flash before the whole image checked out
+    CHECK_INT(host_ota_begin_calls, 0);
+
+    CHECK_INT(ota_writer_end(&writer, test_sha256), ESP_OK);
+    CHECK_INT(ota_writer_activate(&writer), ESP_OK);
+
+    CHECK_INT(host_ota_begin_calls, 1);
+    CHECK(memcmp(host_flash, test_image, TEST_IMAGE_LEN) == 0);
+    CHECK(host_boot_partition == writer.partition);
+    CHECK(!ota_writer_is_busy());
+}
+
+static void test_staging_falls_back_without_psram(void) {
+    ota_writer_t writer;
+
+    host_psram_size = TEST_IMAGE_LEN - 1;
+
+    CHECK_INT(ota_writer_begin(&writer), ESP_OK);
+    CHECK(!ota_writer_stage(&writer, TEST_IMAGE_LEN));
+    CHECK_INT(write_image(&writer, test_image, TEST_IMAGE_LEN, 4096), ESP_OK);
+    CHECK_INT(host_ota_begin_calls, 1);
+    CHECK_INT(ota_writer_end(&writer, test_sha256), ESP_OK);
+
+    ota_writer_abort(&writer, OTA_FAILURE_RECV_ERROR);
+}
+
+static void test_staged_truncated_image_keeps_flash(void) {
+    ota_writer_t writer;
+    long short_bodies = failures("short_body");
+
+    host_psram_size = HOST_PARTITION_SIZE;
+
+    CHECK_INT(ota_writer_begin(&writer), ESP_OK);
+    CHECK(ota_writer_stage(&writer, TEST_IMAGE_LEN));
+    CHECK_INT(write_image(&writer, test_image, TEST_IMAGE_LEN - 1, 4096), ESP_OK);
+    CHECK(ota_writer_end(&writer, NULL) != ESP_OK);
+
+    CHECK_INT(writer.failure, OTA_FAILURE_SHORT_BODY);
+    CHECK_INT(failures("short_body"), short_bodies + 1);
+    CHECK_INT(host_ota_begin_calls, 0);
+    CHECK(!ota_writer_is_busy());
+}
+
+static void test_staged_oversized_image(void) {
+    ota_writer_t writer;
+
+    host_psram_size = HOST_PARTITION_SIZE;
+
+    CHECK_INT(ota_writer_begin(&writer), ESP_OK);
+    CHECK(ota_writer_stage(&writer, TEST_IMAGE_LEN - 1));
+    CHECK(write_image(&writer, test_image, TEST_IMAGE_LEN, 4096) != ESP_OK);
+    CHECK_INT(writer.failure, OTA_FAILURE_INVALID_IMAGE);
+    CHECK_INT(host_ota_begin_calls, 0);
+    CHECK(!ota_writer_is_busy());
+}
+
+static void test_staged_image_checks(void) {
+    static uint8_t image[TEST_IMAGE_LEN];
+    ota_writer_t writer;
+    esp_image_header_t *header = (esp_image_header_t *)image;
+    int i;
+
+    host_psram_size = HOST_PARTITION_SIZE;
+
+    // wrong header magic, other chip, no app description, corrupted payload behind an appended hash
+    for (i = 0; i < 4; i++) {
+        memcpy(image, test_image, sizeof(image));
+
+        switch (i) {
+            case 0:
+                header->magic = 0;
+                break;
+            case 1:
+                header->chip_id = CONFIG_IDF_FIRMWARE_CHIP_ID + 1;
+                break;
+            case 2:
+                image[sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t)] ^= 0xff;
+                break;
+            case 3:
+                image[TEST_IMAGE_LEN / 2] ^= 0xff;
+                break;
+        }
+
+        CHECK_INT(ota_writer_begin(&writer), ESP_OK);
+        CHECK(ota_writer_stage(&writer, TEST_IMAGE_LEN));
+        CHECK_INT(write_image(&writer, image, TEST_IMAGE_LEN, 4096), ESP_OK);
+        CHECK(ota_writer_end(&writer, NULL) != ESP_OK);
+        CHECK_INT(writer.failure, OTA_FAILURE_INVALID_IMAGE);
+    }
+
+    // the expected hash is checked as well
+    CHECK_INT(ota_writer_begin(&writer), ESP_OK);
+    CHECK(ota_writer_stage(&writer, TEST_IMAGE_LEN));
+    CHECK_INT(write_image(&writer, image, TEST_IMAGE_LEN, 4096), ESP_OK);
+    CHECK_INT(ota_writer_end(&writer, test_sha256), ESP_ERR_INVALID_CRC);
+
+    CHECK_INT(host_ota_begin_calls, 0);
+    CHECK(!ota_writer_is_busy());
+}
+
+static void test_staged_flash_write_error(void) {
+    ota_writer_t writer;
+    long flash_errors = failures("flash_error");
+
+    host_psram_size = HOST_PARTITION_SIZE;
+    host_ota_write_fail_at = 2;
+
+    CHECK_INT(ota_writer_begin(&writer), ESP_OK);
+    CHECK(ota_writer_stage(&writer, TEST_IMAGE_LEN));
+    CHECK_INT(write_image(&writer, test_image, TEST_IMAGE_LEN, 4096), ESP_OK);
+    CHECK(ota_writer_end(&writer, test_sha256) != ESP_OK);
+
+    CHECK_INT(writer.failure, OTA_FAILURE_FLASH_ERROR);
+    CHECK_INT(failures("flash_error"), flash_errors + 1);
+    CHECK_INT(host_ota_abort_calls, 1);
+    CHECK(!ota_writer_is_busy());
+}
+
+int main(void) {
+    test_make_image(test_image, sizeof(test_image));
+    mbedtls_sha256(test_image, sizeof(test_image), test_sha256, 0);
+
+    RUN_TEST(test_progress_ok_while_data_flows);
+    RUN_TEST(test_progress_stall);
+    RUN_TEST(test_progress_silent_client_stalls);
+    RUN_TEST(test_progress_slow_client);
+    RUN_TEST(test_streamed_image);
+    RUN_TEST(test_busy);
+    RUN_TEST(test_short_first_chunk);
+    RUN_TEST(test_flash_write_error);
+    RUN_TEST(test_end_without_data);
+    RUN_TEST(test_sha256_mismatch);
+    RUN_TEST(test_image_validation_failure);
+    RUN_TEST(test_ota_end_flash_error);
+    RUN_TEST(test_prepare_rejects_oversized_image);
+    RUN_TEST(test_staged_image);
+    RUN_TEST(test_staging_falls_back_without_psram);
+    RUN_TEST(test_staged_truncated_image_keeps_flash);
+    RUN_TEST(test_staged_oversized_image);
+    RUN_TEST(test_staged_image_checks);
+    RUN_TEST(test_staged_flash_write_error);
+
+    return test_result();
+}
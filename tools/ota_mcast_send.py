@@ -0,0 +1,169 @@
+#!/usr/bin/env python3
+"""Send a firmware image to every node listening on the OTA multicast group.
+
+The image is announced first and the first pass waits until receivers, which
+erase their partition before they can take data, answer with a NACK. Blocks
+are then multicast once and missing blocks reported by unicast NACKs are
+resent until every node answers with DONE (or FAILED, when it rejected the
+image) or the group stays quiet.
+Pass --iface 127.0.0.1 to exercise a receiver on the same host over loopback.
+"""
+
+import argparse
+import hashlib
+import socket
+import struct
+import sys
+import time
+
+MAGIC = 0x4D4F5441
+TYPE_DATA = 1
+TYPE_END = 2
+TYPE_NACK = 3
+TYPE_DONE = 4
+TYPE_FAILED = 5
+
+# OTA_FAILURE_* reasons, see metrics_failure_name()
+FAILURES = ["none", "stall", "slow_client", "short_body", "recv_error", "flash_error", "invalid_image", "busy"]
+
+HEADER = struct.Struct("<IBBHII32s")
+RANGE = struct.Struct("<II")
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("image", help="firmware image (.bin)")
+    parser.add_argument("--group", default="239.255.77.1")
+    parser.add_argument("--port", type=int, default=3233)
+    parser.add_argument("--iface", default="0.0.0.0", help="local address to send from")
+    parser.add_argument("--ttl", type=int, default=1)
+    parser.add_argument("--block-size", type=int, default=1024)
+    parser.add_argument("--rate", type=int, default=400, help="packets per second")
+    parser.add_argument("--nodes", type=int, default=0, help="stop once this many nodes reported DONE or FAILED")
+    parser.add_argument("--quiet", type=float, default=3.0, help="stop after this many seconds without NACKs")
+    parser.add_argument(
+        "--announce", type=float, default=20.0, help="seconds to wait for receivers to get ready before the first pass"
+    )
+    args = parser.parse_args()
+
+    with open(args.image, "rb") as f:
+        image = f.read()
+
+    sha256 = hashlib.sha256(image).digest()
+    block_count = (len(image) + args.block_size - 1) // args.block_size
+
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM, socket.IPPROTO_UDP)
+    sock.bind((args.iface, 0))
+    sock.setsockopt(socket.IPPROTO_IP, socket.IP_MULTICAST_TTL, args.ttl)
+    sock.setsockopt(socket.IPPROTO_IP, socket.IP_MULTICAST_IF, socket.inet_aton(args.iface))
+    sock.setsockopt(socket.IPPROTO_IP, socket.IP_MULTICAST_LOOP, 1)
+
+    def send(packet_type, block=0, payload=b""):
+        header = HEADER.pack(MAGIC, packet_type, 0, args.block_size, len(image), block, sha256)
+        sock.sendto(header + payload, (args.group, args.port))
+
+    def send_blocks(blocks):
+        for block in blocks:
+            offset = block * args.block_size
+            send(TYPE_DATA, block, image[offset : offset + args.block_size])
+            time.sleep(1.0 / args.rate)
+        send(TYPE_END)
+
+    def receive(duration):
+        """Yield (type, address, packet) of replies about this image for duration seconds."""
+        deadline = time.monotonic() + duration
+
+        sock.settimeout(0.1)
+        while time.monotonic() < deadline:
+            try:
+                packet, addr = sock.recvfrom(2048)
+            except socket.timeout:
+                continue
+
+            if len(packet) < HEADER.size:
+                continue
+
+            magic, packet_type, _, _, _, _, packet_sha256 = HEADER.unpack_from(packet)
+            if magic == MAGIC and packet_sha256 == sha256:
+                yield packet_type, addr[0], packet
+
+    done = set()
+    failed = set()
+
+    def mark_done(addr):
+        if addr not in done:
+            done.add(addr)
+            print(f"{addr}: image verified ({len(done)} done)")
+
+    def mark_failed(addr, packet):
+        reason = packet[HEADER.size] if len(packet) > HEADER.size else 0
+        if addr not in failed:
+            failed.add(addr)
+            print(f"{addr}: image rejected ({FAILURES[reason] if reason < len(FAILURES) else reason})")
+
+    def finished():
+        return len(done | failed)
+
+    print(f"announcing {len(image)} bytes in {block_count} blocks, sha256 {sha256.hex()}")
+
+    # receivers erase the partition when they see the image and drop whatever arrives meanwhile, their first NACK
+    # says they are ready
+    ready = set()
+    start = time.monotonic()
+    last_ready = start
+
+    while time.monotonic() - start < args.announce:
+        send(TYPE_END)
+
+        for packet_type, addr, packet in receive(0.5):
+            if packet_type == TYPE_DONE:
+                mark_done(addr)
+            elif packet_type == TYPE_FAILED:
+                mark_failed(addr, packet)
+            elif packet_type == TYPE_NACK and addr not in ready:
+                ready.add(addr)
+                last_ready = time.monotonic()
+                print(f"{addr}: ready")
+
+        if args.nodes and len(ready | done | failed) >= args.nodes:
+            break
+        if not args.nodes and (ready or done or failed) and time.monotonic() - last_ready > args.quiet:
+            break
+
+    if not args.nodes or finished() < args.nodes:
+        print(f"sending to {len(ready)} ready node(s)")
+        send_blocks(range(block_count))
+
+    last_nack = time.monotonic()
+
+    while not (args.nodes and finished() >= args.nodes):
+        missing = set()
+
+        for packet_type, addr, packet in receive(1.0):
+            if packet_type == TYPE_DONE:
+                mark_done(addr)
+
+            elif packet_type == TYPE_FAILED:
+                mark_failed(addr, packet)
+
+            elif packet_type == TYPE_NACK:
+                last_nack = time.monotonic()
+                received = HEADER.unpack_from(packet)[5]
+                for i in range(HEADER.size, len(packet) - RANGE.size + 1, RANGE.size):
+                    first, count = RANGE.unpack_from(packet, i)
+                    missing.update(range(first, min(first + count, block_count)))
+                print(f"{addr}: {received}/{block_count} blocks")
+
+        if missing:
+            send_blocks(sorted(missing))
+        elif time.monotonic() - last_nack > args.quiet:
+            break
+        else:
+            send(TYPE_END)
+
+    print(f"{len(done)} node(s) updated, {len(failed)} rejected the image")
+    return 0 if not failed and (not args.nodes or len(done) >= args.nodes) else 1
+
+
+if __name__ == "__main__":
+    sys.exit(main())